@@ -0,0 +1,326 @@
+/*--------------------------------------------------------------------------
+ YZ125/250 CDI UART bootloader
+------------------------------------------------------------------------- */
+
+/*
+ Lives in the 512 word boot block (0x000-0x1FF). The application is linked
+ with -mcodeoffset=0x200, so its reset vector is 0x200 and its interrupt
+ vector 0x204. The last boot block row (BOOT_MARK_ADDR) holds the valid
+ image mark and is never part of the bootloader code.
+
+ Build (separate image, programmed once with PICkit):
+   xc8-cc -mcpu=16F15245 -O2 -mrom=0-1DF -o yz_boot.hex boot.c
+ Config bits come from yz_cdi.h, as an application loaded through the
+ bootloader cannot change them.
+
+ Boot mode is entered when
+   - the valid mark is missing (no image, or an interrupted upload)
+   - the application asked for it with the PB command (RESET instruction)
+   - RX (RB7) is held low (UART break) at power up
+ With a valid image and no frame received for 2s (TMR0), the
+ application is started, so a stray PB command does not leave the engine
+ without ignition.
+
+ Protocol, BOOT_BRG baud 8N1. Frame = cmd + payload + CRC16 (CCITT, 0xFFFF,
+ low byte first) over cmd and payload. Words are sent low byte first.
+   'S'                               sync              -> 'K'
+   'W' addr(2) data(64)              write one row      -> 'K' / 'N' / 'E'
+   'V' end(2) crc(2)                 check image, mark  -> 'K' / 'N' / 'E'
+   'R'                               run application    -> 'K' / 'N'
+ 'N': bad frame CRC or address, 'E': verify or write error.
+ The first 'W' of a session erases the valid mark. 'V' computes the CRC16 of
+ the words 0x200..end-1 and writes the mark only if it matches.
+ */
+
+#include<xc.h>
+#include<stdint.h>
+#include "../YZ_CDI_PROT_1.0.X/yz_cdi.h"
+
+#define _XTAL_FREQ 32000000
+
+//-------------------------------
+// Memory map
+//-------------------------------
+#define APP_ADDR            (0x200)         //Application reset vector. asm below uses 0x200 and 0x204
+#define FLASH_END           (0x2000)
+#define ROW_SIZE            (32)            //Words per erase/write row
+#define BOOT_MARK_ADDR      (0x1E0)         //Last boot block row: valid mark
+#define BOOT_MAGIC          (0x2A5A)        //14bit
+
+//-------------------------------
+// UART and timeout
+//-------------------------------
+#define BOOT_BRG            (15)            //BRG16, BRGH: 32MHz / (4 * (15 + 1)) = 500kbaud. 7:1Mbaud
+#define BOOT_TIMEOUT_IF     TMR0IF          //TMR0 16bit, Fosc/4 1:256: 2.1s
+
+//-------------------------------
+// Proto type
+//-------------------------------
+void main(void);
+void boot_run(void);
+uint8_t boot_getc(void);
+void boot_putc(uint8_t c);
+void crc_byte(uint8_t b);
+uint16_t flash_read(uint16_t addr);
+uint8_t flash_write_row(uint16_t addr, const uint8_t *data);
+void nvm_unlock(void);
+
+//-------------------------------
+// Variables
+//-------------------------------
+uint8_t frame[1 + 2 + 2 * ROW_SIZE];    //cmd + addr + row
+uint16_t crc;
+uint8_t boot_hold = 0;                  //1:host is present, no timeout
+uint8_t boot_session = 0;               //1:valid mark erased
+
+//-------------------------------
+// Interrupt
+// The bootloader runs with interrupts off. Forward to the application.
+//-------------------------------
+
+void __interrupt() boot_isr(void) {
+    asm("PAGESEL 0x204");
+    asm("GOTO 0x204");
+}
+
+//-------------------------------
+// Main
+//-------------------------------
+
+void main(void) {
+    uint8_t a, n, enter;
+    uint16_t addr, end, w;
+
+    enter = (PCON0bits.nRI == 0);
+    PCON0bits.nRI = 1;
+    ANSELBbits.ANSB7 = 0;
+    WPUBbits.WPUB7 = 1;
+    __delay_us(20);
+    if (PORTBbits.RB7 == 0) enter = 1;
+    if (flash_read(BOOT_MARK_ADDR) != BOOT_MAGIC) {
+        enter = 1;
+        boot_hold = 1;
+    }
+    if (!enter) boot_run();
+
+    //UART on the application pins. PPS is not locked, the application does it
+    TRISBbits.TRISB6 = 0;
+    ANSELBbits.ANSB6 = 0;
+    RX1PPS = 0x0F; //RX1 = RB7
+    RB6PPS = 0x05; //TX1 = RB6
+    BAUD1CON = 0x08; //BRG16
+    SP1BRGL = BOOT_BRG;
+    SP1BRGH = 0;
+    TX1STA = 0x24; //TXEN, BRGH
+    RC1STA = 0x90; //SPEN, CREN
+    T0CON1 = 0b01001000; //Fosc/4, 1:256
+    T0CON0 = 0b10010000; //On, 16bit
+    BOOT_TIMEOUT_IF = 0;
+
+    while (1) {
+        frame[0] = boot_getc();
+        switch (frame[0]) {
+        case 'W':
+            n = 1 + 2 + 2 * ROW_SIZE;
+            break;
+        case 'V':
+            n = 1 + 2 + 2;
+            break;
+        case 'R':
+        case 'S':
+            n = 1;
+            break;
+        default:
+            continue; //Break, noise or lost sync
+        }
+        crc = 0xFFFF;
+        crc_byte(frame[0]);
+        for (a = 1; a < n; a++) {
+            frame[a] = boot_getc();
+            crc_byte(frame[a]);
+        }
+        w = boot_getc();
+        w |= (uint16_t) boot_getc() << 8;
+        if (crc != w) {
+            boot_putc('N');
+            continue;
+        }
+        boot_hold = 1;
+        addr = frame[1] | ((uint16_t) frame[2] << 8);
+        switch (frame[0]) {
+        case 'W':
+            if ((addr < APP_ADDR) || (addr >= FLASH_END) || (addr & (ROW_SIZE - 1))) {
+                boot_putc('N');
+                break;
+            }
+            if (!boot_session) {
+                boot_session = 1;
+                NVMADR = BOOT_MARK_ADDR;
+                NVMCON1 = 0b00010100; //FREE, WREN: row erase
+                nvm_unlock();
+                NVMCON1bits.WREN = 0;
+            }
+            boot_putc(flash_write_row(addr, &frame[3]) ? 'E' : 'K');
+            break;
+        case 'V':
+            //addr is the end of the checked area
+            end = addr;
+            if ((end <= APP_ADDR) || (end > FLASH_END)) {
+                boot_putc('N');
+                break;
+            }
+            crc = 0xFFFF;
+            for (addr = APP_ADDR; addr < end; addr++) {
+                w = flash_read(addr);
+                crc_byte(w & 0xFF);
+                crc_byte(w >> 8);
+            }
+            if (crc != (frame[3] | ((uint16_t) frame[4] << 8))) {
+                boot_putc('N');
+                break;
+            }
+            frame[0] = BOOT_MAGIC & 0xFF;
+            frame[1] = BOOT_MAGIC >> 8;
+            frame[2] = end & 0xFF;
+            frame[3] = end >> 8;
+            frame[4] = crc & 0xFF;
+            frame[5] = crc >> 8;
+            for (a = 6; a < 2 * ROW_SIZE; a++) frame[a] = 0xFF;
+            if (flash_write_row(BOOT_MARK_ADDR, frame)) {
+                boot_putc('E');
+                break;
+            }
+            boot_session = 0;
+            boot_putc('K');
+            break;
+        case 'R':
+            if (flash_read(BOOT_MARK_ADDR) != BOOT_MAGIC) {
+                boot_putc('N');
+                break;
+            }
+            boot_putc('K');
+            while (!TRMT);
+            boot_run();
+            break;
+        default:
+            boot_putc('K');
+            break;
+        }
+    }
+}
+
+//-------------------------------
+// Start application
+// Used peripherals back to reset state. Never returns.
+//-------------------------------
+
+void boot_run(void) {
+    RC1STA = 0x00;
+    TX1STA = 0x02;
+    BAUD1CON = 0x00;
+    SP1BRGL = 0x00;
+    T0CON0 = 0x00;
+    T0CON1 = 0x00;
+    TMR0H = 0xFF;
+    TMR0L = 0x00;
+    TMR0IF = 0;
+    RX1PPS = 0x0F;
+    RB6PPS = 0x00;
+    TRISBbits.TRISB6 = 1;
+    ANSELB = 0xFF;
+    WPUB = 0x00;
+    NVMCON1 = 0x00;
+    STKPTR = 0x1F; //Empty stack, as after reset
+    asm("PAGESEL 0x200");
+    asm("GOTO 0x200");
+}
+
+//-------------------------------
+// UART read one byte
+// Application is started at timeout until a valid frame has arrived
+//-------------------------------
+
+uint8_t boot_getc(void) {
+    while (!RC1IF) {
+        if ((BOOT_TIMEOUT_IF)&&(!boot_hold)) boot_run();
+    }
+    if (RC1STAbits.OERR) {
+        RC1STAbits.CREN = 0;
+        RC1STAbits.CREN = 1;
+    }
+    return RC1REG;
+}
+
+//-------------------------------
+// UART write one byte
+//-------------------------------
+
+void boot_putc(uint8_t c) {
+    while (!TRMT);
+    TX1REG = c;
+}
+
+//-------------------------------
+// CRC16 CCITT (0x1021) one byte
+//-------------------------------
+
+void crc_byte(uint8_t b) {
+    uint8_t a;
+
+    crc ^= (uint16_t) b << 8;
+    for (a = 0; a < 8; a++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+}
+
+//-------------------------------
+// Program flash read one word
+//-------------------------------
+
+uint16_t flash_read(uint16_t addr) {
+    NVMADR = addr;
+    NVMCON1 = 0x00;
+    NVMCON1bits.RD = 1;
+    return NVMDAT;
+}
+
+//-------------------------------
+// Program flash row write
+// Erase one row at addr (row aligned), write 32 words and read them back.
+// Returns 0:done 1:write or verify error
+//-------------------------------
+
+uint8_t flash_write_row(uint16_t addr, const uint8_t *data) {
+    uint8_t a;
+
+    NVMADR = addr;
+    NVMCON1 = 0b00010100; //FREE, WREN: row erase
+    nvm_unlock();
+    NVMCON1 = 0b00100100; //LWLO, WREN: load write latches
+    for (a = 0; a < ROW_SIZE; a++) {
+        NVMADR = addr + a;
+        NVMDATL = data[2 * a];
+        NVMDATH = data[2 * a + 1] & 0x3F;
+        if (a == ROW_SIZE - 1) NVMCON1bits.LWLO = 0; //Last word starts row write
+        nvm_unlock();
+    }
+    NVMCON1bits.WREN = 0;
+    if (NVMCON1bits.WRERR) return 1;
+    for (a = 0; a < ROW_SIZE; a++) {
+        if (flash_read(addr + a) != ((data[2 * a] | ((uint16_t) data[2 * a + 1] << 8)) & 0x3FFF)) return 1;
+    }
+    return 0;
+}
+
+//-------------------------------
+// NVM unlock sequence and start
+// Interrupts are never enabled here
+//-------------------------------
+
+void nvm_unlock(void) {
+    NVMCON2 = 0x55;
+    NVMCON2 = 0xAA;
+    NVMCON1bits.WR = 1;
+    NOP();
+    NOP();
+}
@@ -30,32 +30,59 @@
 // PIN I/O
 //-------------------------------
 //output
-#define PWJOUT  LATA0   //Solenoid drive signal for PWK38(with power jet)
+#define PWJOUT  LATA0   //Solenoid drive signal for PWK38(with power jet). Driven by PWM3 (RA0PPS)
 #define IGOUT   LATC1   //Digital iginition output
 #define IGEN    LATC2   //0:PU2 ignition is ENABLED 1:PU2 Ignition is DISABLED
+#define YPVS_OUT LATC3  //Exhaust power valve servo signal. Driven by PWM4 (RC3PPS). YPVS_ENABLE only
 //input
 #define PU1IN   RC0     //1st Pick up signal detect (falling edge of 1to 0)
 #define PU2IN   RA2     //2nd Pick up signal detect (rising edge of 0to 1)
 #define PWJ_SEL RC5     //pwj enable or disable select input
 #define REV_SEL RA4     //Rev limitter enable or disable select input 
 #define ADST_1  PORTCbits.RC4     //Advance start rpm setting input 1
-#define ADST_2  PORTCbits.RC3     //Advance start rpm setting input 2
-#define MAXAD_1  PORTCbits.RC6    //Maximum advance setting input 1
+#define ADST_2  PORTCbits.RC3     //Advance start rpm setting input 2. Not used with YPVS_ENABLE
+#define MAXAD_1  PORTCbits.RC6    //Maximum advance setting input 1. Not used with POT_ENABLE
 #define MAXAD_2  PORTCbits.RC7    //Maximum advance setting input 2
 #define GRAD_1  PORTBbits.RB7     //Grad. of advanve setting input 1
 #define GRAD_2  PORTBbits.RB6     //Grad. of advanve setting input 2
 #define ADRV_1  PORTBbits.RB5     //Minimun retard @Hi speed setting input 1
 #define ADRV_2  PORTBbits.RB4     //Minimun retard @Hi speed setting input 2
+#define LAUNCH_SW RA1   //Launch control (clutch) switch input. IOC both edges
+#define QS_IN   RB4     //Quick shifter sensor input (falling edge). SW4 pin 2 (ADRV_2). QS_ENABLE only
+//analog
+//ANA5 (RA5)            //Throttle position sensor (MCU_TPSIN). Sampled by ADC auto trigger
+//ANC6 (RC6)            //Map blend potentiometer. POT_ENABLE only
+//CDI capacitor charge voltage is not monitored: the CAP CHG net does not reach
+//the MCU and no analog pin is free for a divider (RA3 is MCLR, input only).
+//Sampling it at CCP2 needs a board change that routes it to a freed ANx pin.
 
 //-------------------------------
 // Proto type
 //-------------------------------
 void main(void);
+void boot(void);
+uint8_t main_pass(void);
+void initialize_ignition(void);
 void initialize_system(void);
 void __interrupt() InterruptManager(void);
 void check_sw_state(void);
 void calc_map(void);
+void ig_map_col(void);
+void ig_map_update(void);
+uint16_t ig_map_wait(uint16_t a);
+uint8_t cal_write_row(uint16_t addr, const uint8_t *data, uint8_t n);
+void param_load(void);
+void param_update(void);
+void param_rx(void);
+void param_cmd(void);
+void ig_map_cmd(void);
+void nvm_unlock(void);
+void adc_tmr2_sel(void);
+void ig_pipeline(void);
+void ig_next_seg(void);
+void eg_set_state(uint8_t state);
 void ignition_disable(void);
+uint8_t ig_arm(uint16_t count, uint8_t margin);
 void ccp1_enable(void);
 void ccp1_disable(void);
 void ccp2_enable(void);
@@ -63,14 +90,41 @@ void ccp2_disable(void);
 void Write_Byte(char chr);
 void WriteString(const char *str);
 void Write_table(void);
+void publish_snapshot(void);
+void read_snapshot(void);
+void launch_sw_sample(void);
+void pwj_update(void);
+void ypvs_update(void);
+uint16_t get_tick(void);
+uint16_t fx_mulh16x8(uint16_t a, uint8_t b);
+uint16_t fx_mulh16x16(uint16_t a, uint16_t b);
+uint16_t fx_recip16(uint16_t x);
+uint16_t fx_divf16(uint24_t n, uint24_t d);
+uint16_t fx_adds16(uint16_t a, int16_t b);
+uint16_t period_rpm(uint24_t period, uint8_t ps);
 
 //-------------------------------
 // Engine state
 //-------------------------------
 
+//-------------------------------
+// EG_STOPPED   TMR1 stopped. First PU1 restarts it -> EG_SYNCING
+// EG_SYNCING   Waiting for the 2nd PU1. Its period sparks at once -> by rpm
+// EG_CRANKING  Under RUN_ENTER_RPM. No PU1 filter
+// EG_RUNNING   From RUN_ENTER_RPM down to RUN_EXIT_RPM. PU1 filter on
+// EG_LIMP      LIMP_ENTER_REV implausible periods in a row. PU2 analog ignition
+//              only, until LIMP_EXIT_REV plausible periods in a row -> by rpm
+// PU1 lost (PU2 later than plausible period from last PU1) -> EG_LIMP on PU2
+// Any state -> EG_STOPPED at TMR1 overflow timeout. PU2 analog ignition is
+// enabled while stopped and syncing, so the first revolution is not dead.
+//-------------------------------
+
 typedef enum {
-    EG_LOW,
-    EG_RUN,
+    EG_STOPPED,
+    EG_CRANKING,
+    EG_SYNCING,
+    EG_RUNNING,
+    EG_LIMP,
 } EG_STATE;
 
 typedef enum {
@@ -82,8 +136,68 @@ typedef enum {
     REVLIMIT_ENABLE,
     REVLIMIT_DISABLE,
 } REVLIMIT_STATE;
+
+typedef enum {
+    LAUNCH_DISABLE,
+    LAUNCH_ENABLE,
+} LAUNCH_STATE;
+
+typedef enum {
+    ADC_TPS,
+    ADC_POT,
+} ADC_CH;
 //
 
+//-------------------------------
+// Engine snapshot
+// ISR publishes rpm/ig_counter/t1_count/EG_state once per revolution.
+// "seq" is odd while the ISR is writing. The main loop copies the
+// snapshot and retries when seq was odd or has changed (torn copy).
+//-------------------------------
+
+typedef struct {
+    uint8_t seq;
+    uint8_t EG_state;
+    uint16_t rpm;
+    uint16_t ig_counter;
+    uint16_t t1_count;
+    uint8_t t1_ovf;
+    uint8_t t1_ps;
+    uint16_t pu1_noise_cnt;
+    uint16_t pu1_resync_cnt;
+    uint16_t eg_trans_cnt;
+} ENGINE_SNAPSHOT;
+
+//-------------------------------
+// Switch curve (IG_MAP_2D 0)
+// Break points of the advance curve set by the switches, in map bins and
+// *100deg. Slopes per bin in 1/256 deg*100 (within 16bit: 20 bins or more
+// per slope).
+//-------------------------------
+
+typedef struct {
+    uint16_t p1x, p2x, p3x, p4x;
+    uint16_t p1y, p3y, p4y;
+    int16_t slope1;         //p1 to p2 (p2y = p3y)
+    int16_t slope2;         //p3 to p4
+} IG_CURVE;
+
+//-------------------------------
+// Runtime parameter block
+// Words only, so UART edits address it as uint16_t[PARAM_WORDS].
+// "sum" makes the sum of all words 0.
+//-------------------------------
+
+typedef struct {
+    uint16_t ver;           //PARAM_VER
+    uint16_t revlimit_rpm;  //Main rev limitter H (rpm)
+    uint16_t launch_rpm;    //Launch limitter H (rpm)
+    uint16_t qs_min_rpm;    //Quick shifter ignored under this (rpm)
+    uint16_t pwj_hold_ms;   //Power jet duty hold time (ms)
+    uint16_t pu1_deg;       //PU1 angle BTDC (*100deg)
+    uint16_t sum;
+} PARAM_BLOCK;
+
 //-------------------------------
 // CDI definition
 //-------------------------------
@@ -91,15 +205,324 @@ typedef enum {
 #define IG_GATE_ON          (1)     //IGBT gate driver input ON
 #define IG_DISABLE          (1)     //IGBT gate driber enable pin OFF
 #define IG_ENABLE           (0)     //IGBT gate driber enable pin ON
-#define FIXED_IG_RPM        (15)    //Fixed ignition timing RPM
-#define MAX_MAP_RPM         (130)   //Max RPM of ignition map
-#define REVLIMIT_L          (97)    //Rev limitter enable Low RPM. Ignition once every 2 revolutions
-#define REVLIMIT_M          (98)    //Rev limitter enable Mid RPM. Ignition once every 3 revolutions
-#define REVLIMIT_H          (99)    //Rev limitter enable Hi RPM. Ignition is disabled
-#define PWJ_CUT_RPMH        (85)    //Power jet cut rpm @Power jet Enable
-#define PWJ_CUT_RPML        (83)    //For hysteresis
-#define PWJ_DISABLE_RPMH    (30)    //Power jet cut rpm @Power jet Disaable
-#define PWJ_DISABLE_RPML    (28)    //For hysteresis
+#define RPM_BIN_WIDTH       (50)    //rpm per map bin. "rpm" is counted in this unit (50 or 100)
+#define RPM2BIN(x)          ((x) / RPM_BIN_WIDTH)           //rpm -> map bin
+#define RPM100_2BIN(x)      ((x) * (100 / RPM_BIN_WIDTH))   //*100rpm -> map bin
+#define CRANK_MIN_RPM       RPM2BIN(200)    //Digital ignition by cranking map from this RPM
+#define FIXED_IG_RPM        RPM2BIN(1500)   //Cranking map end / ignition map start RPM
+#define MAX_MAP_RPM         RPM2BIN(16000)  //Max RPM of ignition map
+#define MAP_SIZE            (MAX_MAP_RPM + 1)
+#define REVLIMIT_L          RPM2BIN(9500)   //Rev limitter table start RPM (see Rev limitter table)
+#define REVLIMIT_H          RPM2BIN(9900)   //Rev limitter enable Hi RPM. Ignition is disabled
+#define LAUNCH_L            RPM2BIN(5600)   //Launch limitter table start RPM
+#define LAUNCH_H            RPM2BIN(6000)   //Launch limitter Hi RPM. Ignition is disabled
+#define LAUNCH_ACTIVE       (0)             //LAUNCH_SW level when clutch is held (pulled up, switch to GND)
+#define LAUNCH_DEBOUNCE_REV (4)             //LAUNCH_SW edges are ignored for this revolutions after an edge
+#define QS_MIN_RPM          RPM2BIN(3000)   //Quick shifter is ignored under this RPM
+#define RUN_ENTER_RPM       FIXED_IG_RPM    //EG_CRANKING -> EG_RUNNING
+#define RUN_EXIT_RPM        RPM2BIN(1300)   //EG_RUNNING -> EG_CRANKING (hysteresis)
+#define LIMP_ENTER_REV      (3)             //Implausible PU1 periods in a row to enter EG_LIMP
+#define LIMP_EXIT_REV       (16)            //Plausible PU1 periods in a row to leave EG_LIMP
+
+//-------------------------------
+// Period to rpm
+// rpm = RPM_NUM(shift) / period, period in TMR1 counts of a prescale stage
+// (1 << shift counts per us). 24bit division of the whole period, so the
+// fine prescale is kept and every bin up to MAX_MAP_RPM is reachable
+// (floor to the bin). RPM_NUM(3) is 9.6e6 for 50rpm bins and fits 24bit.
+// Periods shorter than MIN_MAP_PERIOD are clamped to MAX_MAP_RPM + 1
+// so the division never sees 0 and "rpm" never wraps.
+//-------------------------------
+#define RPM_NUM(shift)      ((60000000UL / RPM_BIN_WIDTH) << (shift))
+#define MIN_MAP_PERIOD      (60000000UL / ((uint32_t)MAP_SIZE * RPM_BIN_WIDTH))
+
+//-------------------------------
+// Extended period for cranking
+// TMR1 (1us) overflows every 65.5ms = 915rpm. Overflows are counted in
+// t1_ovf and the period becomes (t1_ovf << 16) + CCPR1. The engine is
+// treated as stopped after EG_STOP_OVF overflows (327ms = 183rpm).
+//-------------------------------
+#define EG_STOP_OVF         (5)
+
+//-------------------------------
+// TMR1 adaptive prescaler
+// Stage   0     1      2
+// Presc.  1:8   1:2    1:1
+// 1count  1us   0.25us 0.125us  (13000rpm: 0.078deg -> 0.0098deg per count)
+// 16bit   915rpm 3662rpm 7324rpm (lowest rpm without overflow)
+// The stage for the next revolution is decided from rpm with hysteresis
+// and applied when TMR1 is restarted at PU1, so a capture and the
+// compare armed from it always use the same prescale.
+// ig_map_wait() gives map bins in 0.125us, shifted to the active stage.
+// Cranking bins are in 1us and only used at stage 0.
+//-------------------------------
+#define T1_PS_STAGES        (3)
+#define T1_PS_FINE_SHIFT    (3)     //log2(0.125us counts per us)
+const uint8_t t1_ps_con[T1_PS_STAGES] = {0b00110010, 0b00010010, 0b00000010}; //T1CON CKPS, RD16, TMR1 off
+const uint8_t t1_ps_shift[T1_PS_STAGES] = {0, 2, 3};        //log2(counts per us)
+const uint8_t t1_ps_stop_ovf[T1_PS_STAGES] = {EG_STOP_OVF, EG_STOP_OVF << 2, EG_STOP_OVF << 3};
+const uint8_t t1_ps_margin[T1_PS_STAGES] = {15, 60, 120}; //Minimum lead of compare to TMR1 (=15us)
+const uint16_t t1_ps_min_period[T1_PS_STAGES] = {MIN_MAP_PERIOD, MIN_MAP_PERIOD << 2, MIN_MAP_PERIOD << 3};
+const uint24_t t1_ps_rpm_num[T1_PS_STAGES] = {RPM_NUM(0), RPM_NUM(2), RPM_NUM(3)};
+const uint16_t t1_ps_up_rpm[T1_PS_STAGES] = {RPM2BIN(4000), RPM2BIN(8000), 0xFFFF};
+const uint16_t t1_ps_down_rpm[T1_PS_STAGES] = {0, RPM2BIN(3800), RPM2BIN(7600)};
+
+#if (FIXED_IG_RPM >= RPM2BIN(3800))
+#error "Cranking map bins must stay in prescaler stage 0"
+#endif
+
+//-------------------------------
+// Rev limitter table
+// Profile 0: main limitter (REV_SEL), 1: launch limitter (LAUNCH_SW held).
+// 100rpm steps from L to H of each profile. Full cut at H or over.
+// Cut ratio is x/REVLIMIT_CUT_FULL. Sparks are skipped by an accumulator
+// (Bresenham), so the pattern is evenly spread and carries over between steps.
+// Retard is added to the waiting time before cutting. It is held in 0.125us
+// counts at the rpm of each step, so the ISR only reads and adds it.
+//-------------------------------
+#define REVLIMIT_MAIN       (0)
+#define REVLIMIT_LAUNCH     (1)
+#define REVLIMIT_STEP       RPM2BIN(100)
+#define REVLIMIT_SIZE       (4)
+#define REVLIMIT_CUT_FULL   (128)
+#define RL_RET(deg, rpm)    (uint16_t) (((uint32_t) (deg) * 40000 / 3) / (rpm)) //*100deg -> 0.125us counts
+
+//main   rpm      9500               9600               9700               9800
+//launch rpm      5600               5700               5800               5900
+const uint8_t revlimit_cut_table[2][REVLIMIT_SIZE] = {
+    {0, 0, 43, 64},
+    {0, 32, 64, 96}
+};
+const uint16_t revlimit_ret_table[2][REVLIMIT_SIZE] = {
+    {RL_RET(200, 9500), RL_RET(300, 9600), RL_RET(300, 9700), RL_RET(300, 9800)},
+    {RL_RET(300, 5600), RL_RET(500, 5700), RL_RET(600, 5800), RL_RET(600, 5900)}
+};
+
+#if ((REVLIMIT_H - REVLIMIT_L) != REVLIMIT_SIZE * REVLIMIT_STEP) || ((LAUNCH_H - LAUNCH_L) != REVLIMIT_SIZE * REVLIMIT_STEP)
+#error "Rev limitter table size does not match L/H"
+#endif
+
+//-------------------------------
+// Quick shifter kill time table
+// 1000rpm steps from QS_MIN_RPM. Kill time and lockout (from the shift edge
+// until the next shift is accepted) are given in ms and converted to
+// revolutions at the rpm of each step at compile time.
+// A spark already armed at the shift edge is cancelled in the IOC ISR,
+// so edge to first suppressed spark is the ISR latency. Otherwise it is
+// the next PU1 (1 revolution max).
+// QS_IN is SW4 pin 2 on the board (no free pin). With that switch on
+// (ADRV_2 = 0, sw4_pos 0 and 2) it is held at GND and never sees an edge,
+// so the quick shifter needs it off or SW4 removed. The sensor (open
+// collector to GND) is wired to SW4 pin 2 and GND. QS_ENABLE 1 is for that
+// wiring only: RB4 gets its pull-up and IOC, and sw4_pos reads ADRV_2 as
+// open. With 0, RB4 stays the ADRV_2 input of SW4.
+//-------------------------------
+#ifndef QS_ENABLE
+#define QS_ENABLE           (0)     //1:Enable (sensor on SW4 pin 2) 0:Disable
+#endif
+#define QS_STEP             RPM2BIN(1000)
+#define QS_SIZE             (14)
+#define QS_REV(ms, rpm)     (uint8_t) (((uint32_t) (ms) * (rpm) + 30000) / 60000)
+
+//rpm                         3000          4000          5000          6000          7000          8000          9000
+//                           10000         11000         12000         13000         14000         15000         16000
+const uint8_t qs_kill_table[QS_SIZE] = {
+    QS_REV(90, 3000), QS_REV(85, 4000), QS_REV(80, 5000), QS_REV(75, 6000), QS_REV(70, 7000), QS_REV(65, 8000), QS_REV(60, 9000),
+    QS_REV(55, 10000), QS_REV(50, 11000), QS_REV(50, 12000), QS_REV(50, 13000), QS_REV(50, 14000), QS_REV(50, 15000), QS_REV(50, 16000)
+};
+const uint8_t qs_lock_table[QS_SIZE] = {
+    QS_REV(250, 3000), QS_REV(250, 4000), QS_REV(250, 5000), QS_REV(250, 6000), QS_REV(250, 7000), QS_REV(250, 8000), QS_REV(250, 9000),
+    QS_REV(250, 10000), QS_REV(250, 11000), QS_REV(250, 12000), QS_REV(250, 13000), QS_REV(250, 14000), QS_REV(250, 15000), QS_REV(250, 16000)
+};
+
+//-------------------------------
+// Power jet duty table
+// PWM3 on RA0 (TMR2 Fosc/4 1:128, period 256 = 244Hz). Duty 0-255,
+// 255 = solenoid always on = power jet cut.
+// [PWJ_SEL map][rpm / 1000][TPS >> PWJ_TPS_SHIFT]. Map 0: PWJ_ENABLE, 1: PWJ_DISABLE.
+// Updated from the main loop. A new duty is applied after it has been
+// requested for PWJ_HOLD_MS (time hysteresis against chatter at a cell
+// border). Duty 0 is applied at once when the engine stops.
+//-------------------------------
+#define PWJ_RPM_STEP        RPM2BIN(1000)
+#define PWJ_RPM_SIZE        (16)
+#define PWJ_TPS_SIZE        (8)
+#define PWJ_TPS_SHIFT       (5)     //TPS 0-255 -> 8 columns
+#define PWJ_HOLD_MS         (100)
+
+//TPS                 0-31 -63 -95-127-159-191-223-255
+const uint8_t pwj_duty_table[2][PWJ_RPM_SIZE][PWJ_TPS_SIZE] = {
+    {
+        {0, 0, 0, 0, 0, 0, 0, 0}, //0rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //1000rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //2000rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //3000rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //4000rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //5000rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //6000rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //7000rpm
+        {128, 128, 128, 128, 128, 128, 128, 128}, //8000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //9000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //10000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //11000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //12000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //13000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //14000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255} //15000rpm-
+    },
+    {
+        {0, 0, 0, 0, 0, 0, 0, 0}, //0rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //1000rpm
+        {0, 0, 0, 0, 0, 0, 0, 0}, //2000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //3000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //4000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //5000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //6000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //7000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //8000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //9000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //10000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //11000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //12000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //13000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255}, //14000rpm
+        {255, 255, 255, 255, 255, 255, 255, 255} //15000rpm-
+    }
+};
+
+//-------------------------------
+// PU2 limp
+// PU1 is treated as lost when a PU2 edge comes later than the PU1
+// plausibility limit (pu1_long) from the last PU1, i.e. about 2 revolutions
+// after the last PU1. Only while the PU1 filter is on (EG_RUNNING, EG_LIMP).
+// TMR1 is then restarted at each PU2 edge (IOC, stage 0 = 1us) and the
+// spark is fired by CCP2 limp_ret_table counts after PU2, from the period
+// of the last PU2 edges. Retard from PU2_deg is given in *100deg at the mid
+// rpm of each 1600rpm band; bands without retard fire by software at the
+// PU2 edge. PU2 analog ignition fires only at the first edge, before a
+// period is known.
+// A PU1 between every two PU2 edges for LIMP_EXIT_REV revolutions is
+// healthy. The next PU1 restarts TMR1 like a stop -> EG_SYNCING.
+// The PU2 timestamp is taken by software, so ISR latency adds to the spark.
+//-------------------------------
+#define LIMP_RPM_STEP       RPM2BIN(1600)
+#define LIMP_SIZE           (11)
+#define LIMP_RET(deg, rpm)  (uint16_t) (((uint32_t) (deg) * 5000) / (3UL * (rpm))) //*100deg -> 1us counts
+
+#if (MAX_MAP_RPM / LIMP_RPM_STEP) >= LIMP_SIZE
+#error "limp_ret_table is made up to 17600rpm"
+#endif
+
+//rpm band 0      1600    3200    4800    6400    8000    9600    11200   12800   14400   16000
+const uint16_t limp_ret_table[LIMP_SIZE] = {
+    LIMP_RET(0, 800), LIMP_RET(0, 2400), LIMP_RET(100, 4000), LIMP_RET(200, 5600), LIMP_RET(300, 7200), LIMP_RET(300, 8800),
+    LIMP_RET(300, 10400), LIMP_RET(300, 12000), LIMP_RET(300, 13600), LIMP_RET(300, 15200), LIMP_RET(300, 16800)
+};
+
+//-------------------------------
+// Throttle transient correction
+// dTPS = newest ADC sample - the one it replaces in the TPS ring buffer
+// (8 samples = 33ms). At TRANS_DTPS or faster opening, TRANS_REV
+// revolutions of correction are started (restarted while still opening).
+// trans_table[revolutions left - 1][rpm / TRANS_RPM_STEP] holds the
+// decayed correction in 0.125us counts (+:retard) at the mid rpm of each
+// 800rpm step, so the ISR only reads and adds it. The map is not changed.
+//-------------------------------
+#define TRANS_DTPS          (150)   //10bit ADC counts per 33ms
+#define TRANS_REV           (8)
+#define TRANS_RPM_STEP      RPM2BIN(800)
+#define TRANS_SIZE          (21)
+#define TR(k, deg, rpm)     (int16_t) (((int32_t) (deg) * (k) * 40000 / (3 * TRANS_REV)) / (rpm)) //*100deg x k/TRANS_REV -> 0.125us counts
+#define TR_ROW(k) { \
+    0, TR(k, 200, 1200), TR(k, 200, 2000), TR(k, 200, 2800), TR(k, 300, 3600), TR(k, 300, 4400), TR(k, 300, 5200), \
+    TR(k, 300, 6000), TR(k, 200, 6800), TR(k, 100, 7600), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+
+#if ((MAX_MAP_RPM + 1) / TRANS_RPM_STEP) >= TRANS_SIZE
+#error "trans_table is made up to 16800rpm"
+#endif
+
+//rpm step 0    800  1600  2400  3200  4000  4800  5600  6400  7200  8000- (mid rpm used)
+const int16_t trans_table[TRANS_REV][TRANS_SIZE] = {
+    TR_ROW(1), TR_ROW(2), TR_ROW(3), TR_ROW(4), TR_ROW(5), TR_ROW(6), TR_ROW(7), TR_ROW(8)
+};
+
+//-------------------------------
+// Exhaust power valve (YPVS) servo
+// PWM4 on RC3 shares TMR2 with the power jet: 4.1ms frame, 4us per duty count.
+// Pulse 1000us (closed) - 2000us (full open). The servo must accept a 244Hz
+// frame (digital servo).
+// Position 0-255 is interpolated from ypvs_pos_table by rpm. Every
+// YPVS_PERIOD_MS the output moves toward it by YPVS_RATE at most.
+// At key-on the valve is swept open and closed YPVS_CLEAN_CYCLES times to
+// clean carbon off. The sweep is stopped when the engine starts.
+// RC3 is SW1 pin 2 (ADST_2) and the board has no free pin, so the servo
+// needs a board rework: SW1 removed (sw1_pos then reads 1 or 3) and the
+// servo signal wired to the RC3 side of SW1 pin 2. YPVS_ENABLE 1 is for that
+// board only. With 0, RC3 stays the SW1 input and PWM4 is not used.
+//-------------------------------
+#define YPVS_ENABLE         (0)     //1:Enable (reworked board) 0:Disable
+#define YPVS_RPM_STEP       RPM2BIN(1000)
+#define YPVS_RPM_SIZE       (17)
+#define YPVS_PERIOD_MS      (20)
+#define YPVS_RATE           (8)             //Position per YPVS_PERIOD_MS. Full stroke in 640ms
+#define YPVS_CLEAN_CYCLES   (2)
+#define YPVS_PULSE_MIN      (1000 / 4)      //PWM4 duty at position 0 (1000us)
+#define YPVS_PULSE_SPAN     (1000 / 4)      //PWM4 duty from position 0 to 255 (1000us)
+
+//rpm            0  1000  2000  3000  4000  5000  6000  7000  8000  9000 10000 11000 12000 13000 14000 15000 16000
+const uint8_t ypvs_pos_table[YPVS_RPM_SIZE] = {
+    0, 0, 0, 0, 0, 0, 0, 32, 128, 224, 255, 255, 255, 255, 255, 255, 255
+};
+
+//-------------------------------
+// Throttle position sensor
+// The ADC is started by TMR2 (ADACT, every PWM period = 4.1ms) and the
+// result is taken in the ADC ISR into a ring buffer of TPS_BUF_SIZE samples.
+// "tps" is the 8bit moving average (33ms), so it is read without waiting.
+// 0-255 is 0V-VDD. No busy-wait on GO in the firmware.
+//-------------------------------
+#define TPS_ADCON0          ((0x05 << 2) | 0x01)    //CHS ANA5, ADC on
+#define ADACT_TMR2          (0x04)
+#define POT_ADCON0          ((0x16 << 2) | 0x01)    //CHS ANC6, ADC on
+#define POT_EVERY           (16)    //Every 16th TMR2 conversion is the blend pot (66ms)
+#define TPS_BUF_SHIFT       (3)
+#define TPS_BUF_SIZE        (1 << TPS_BUF_SHIFT)    //10bit x 8 fits 16bit sum
+
+//-------------------------------
+// Main loop time base
+// TMR0 runs free in 16bit mode, Fosc/4 1:8192. 1tick = 1.024ms, wraps in 67s.
+// No interrupt, so the ignition ISR is never delayed by it.
+// Elapsed time is (uint16_t) (get_tick() - start).
+//-------------------------------
+#define TICK_MS(ms)         (uint16_t) (((uint32_t) (ms) * 1000 + 512) / 1024)
+
+//-------------------------------
+// Main loop while stopped
+// In EG_STOPPED the main loop skips switch scan and telemetry. Parameter
+// commands, power jet, servo and map updates go on. Switches are read
+// again from the first loop after start. The launch switch is sampled by
+// the ISR at the first PU1, as its IOC may be locked out by an edge while
+// stopped.
+// The CPU is not put to Sleep. Fosc would stop TMR2 (power jet and servo
+// PWM, ADC trigger) and the UART receiver, which takes the P and M commands
+// whose flash writes are accepted only while stopped. A PU1 IOC wake would
+// add the oscillator start-up to the first capture.
+//-------------------------------
+
+//-------------------------------
+// PU1 noise filter
+// Blanking: a capture earlier than predicted period >> PU1_BLANK_SHIFT
+//   is noise. It is discarded without touching TMR1 (a compare only).
+// Plausibility: a capture later than predicted + (predicted >> PU1_LONG_SHIFT)
+//   (missed edge) resyncs TMR1 but does not fire by the map.
+// Predicted period = last accepted period. Both are counted in telemetry.
+// Applied in EG_RUNNING and EG_LIMP only. Not while cranking, where kicking
+// changes speed a lot per revolution, and not after a resync: the long
+// period spans two revolutions, so its half would blank the next real edge.
+//-------------------------------
+#define PU1_FILTER_ENABLE   (1)     //1:Enable 0:Disable
+#define PU1_BLANK_SHIFT     (1)     //Blanking window = 1/2 of predicted period
+#define PU1_LONG_SHIFT      (1)     //Implausible period = 1.5 times of predicted period
 
 //-------------------------------
 // Ignition map setting
@@ -110,88 +533,677 @@ typedef enum {
 #define Ret_start_rpm           (55)    //*1/100rpm
 #define Ret_end_rpm             (80)    //*1/100rpm
 #define deg2time_coefficient    (1667)  //For calculate ignition deg to waiting time from PU1 (600,000/360)=1667
+#define DEG2TIME_NUM            (3413333UL) //1024 * (1us counts per deg at 1rpm) / 50 = 1024*1e6*60/360/50
 
 const uint8_t adv_start_rpm_table[4] = {45, 35, 25, 15}; //*100rpm
 const uint16_t max_adv_table[4] = {PU2_deg + 1400, PU2_deg + 1000, PU2_deg + 600, PU2_deg + 200}; //deg
 const uint8_t max_adv_grad_table[4] = {40, 30, 20, 10}; //*100rpm
 const uint16_t min_ret_table[4] = {PU2_deg + 800, PU2_deg + 600, PU2_deg + 400, PU2_deg + 200};
 
+//Cranking map. *100deg BTDC, index = rpm/100 (0-1500rpm). Used from CRANK_MIN_RPM to FIXED_IG_RPM.
+//PU2 analog ignition is disabled in this range, so the angle may be later than PU2_deg.
+const uint16_t crank_deg_table[16] = {
+    200, 200, 200, 200, 200, 200, 300, 300, 300, 300, 400, 400, 400, 450, 450, PU2_deg
+};
+
+//-------------------------------
+// Ignition latency compensation
+// The spark is later than the CCP2 match (and the match later than the
+// PU1 edge seen by TMR1) by: PU1 input filter and Schmitt delay, IGBT
+// gate driver and CDI discharge rise (ISR entry until TMR1 restart is
+// measured at each PU1, see Ignition pipeline). The sum in
+// us is given per 1000rpm (pickup slope changes with rpm) for this build,
+// measured with a scope from pickup to spark. It is subtracted from the
+// waiting time of the bin in ig_map_wait().
+// LAT_COMP_ENABLE 0 keeps the table out of the maps.
+//-------------------------------
+#define LAT_COMP_ENABLE     (1)     //1:Enable 0:Disable
+#define LAT_RPM_STEP        RPM2BIN(1000)
+#if LAT_COMP_ENABLE
+#define LAT_US(a)           (lat_us_table[(a) / LAT_RPM_STEP])
+#else
+#define LAT_US(a)           (0)
+#endif
+
+//rpm                               0  1000  2000  3000  4000  5000  6000  7000  8000  9000 10000 11000 12000 13000 14000 15000 16000
+const uint8_t lat_us_table[(MAX_MAP_RPM / LAT_RPM_STEP) + 1] = {
+    14, 14, 13, 12, 12, 11, 11, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10
+};
+
+//-------------------------------
+// PU1-PU2 segment speed
+// TMR1 at the PU2 edge is the time of the last (PU1_deg - PU2_deg) before
+// TDC, the window where the spark is. The PU2 IOC ISR scales it to a full
+// period, ig_seg = pu2_t x 360 / (pu1_deg - PU2_deg). pu1_deg is a runtime
+// parameter, so param_update() derives the multiplier: integer part
+// pu12_seg_mul and fraction pu12_seg_frac (1/65536 by fx_mulh16x16(), 0 and
+// skipped at the default 35deg). The angle of ig_next stays the map angle
+// at rpm, only its waiting time is converted at the segment speed:
+// ig_next + latency is multiplied by ig_seg / ig_tbin, the bin period of
+// rpm. So the spark follows the crank speed in that window (compression
+// slow down, acceleration) and not the average of the last revolution. Used in
+// EG_RUNNING when ig_seg is within 1/2^SEG_MAX_SHIFT of ig_tbin.
+// TMR1 is read first thing in the ISR, PU2_STAMP_LAT after the edge. It was
+// restarted t1_lat after the PU1 capture, which is longer when the PU1 ISR
+// was held off. Both are corrected. An edge that comes while the ISR runs
+// (CCP2 gate, stage 2) is only seen at the end of it, and t1_lat is in old
+// counts after a prescale change, so those segments are not used.
+//-------------------------------
+#define SEG_MAX_SHIFT       (2)
+#define PU2_STAMP_LAT       (8)     //IOC edge to TMR1 read at ISR entry (instruction cycles)
+
+//-------------------------------
+// Ignition pipeline
+// Stage 1 (PU1 ISR): TMR1 restart and CCP2 armed with ig_next, which was
+//   computed a revolution ahead in counts of the new prescale. The capture
+//   to restart delay (TMR1 - CCPR1) is taken off, so the compare is
+//   referenced to the captured edge and not to ISR entry.
+// Stage 2 (ig_pipeline(), after the spark from CCP2 ISR, or at once when
+//   nothing is armed): rpm, engine state, prescale, limiters and transient
+//   correction -> ig_next, ig_next_arm (0:cut or no map ignition) and IGEN
+//   of the next revolution. A PU2 edge after stage 2 rescales ig_next by
+//   ig_seg, one before it leaves ig_seg to stage 2.
+// rpm of the spark is one period older than ig_seg, which is as fresh as
+// it was. EG_SYNCING has nothing precomputed, its first period is armed
+// late in stage 2.
+// At boot PU1 capture runs before the maps are built. Until main() sets
+// ig_map_ready, stage 2 arms nothing and PU2 analog ignition fires, so an
+// unbuilt (0) map never fires at PU1. boot_ticks is the time from the top
+// of initialize_ignition() to ig_map_ready (TMR0 1:256, 32us), telemetry.
+//-------------------------------
+
+//-------------------------------
+// Fixed point kernels
+// The core has no multiplier. These replace the generic XC8 24/32bit
+// multiply in the map engine. Results are exact floor() unless noted, so a
+// host reference is the plain C expression. Cycles are instruction cycles
+// (125ns), estimated from the loop bodies, call included.
+//   fx_mulh16x8(a, b)   (a * b) >> 8               ~120cy (__mulu24 ~400)
+//   fx_mulh16x16(a, b)  (a * b) >> 16              ~240cy
+//   fx_recip16(x)       65536 / x, x >= 2 (0xFFFF for 0, 1)  ~650cy
+//                       32 entry table + one Newton step, within 1/4096 + 1
+//   fx_divf16(n, d)     n x 65536 / d, n < d < 2^23  ~350cy
+//   fx_adds16(a, b)     a + b saturated to 0..0xFFFF  ~15cy
+// fx_recip16 costs more than a 16/16 division (__lwdiv ~350cy), it pays
+// only when one reciprocal serves several products (map segment slope).
+// Its 65536 / x keeps 16 - log2(x) bits, nothing for a ratio of two
+// periods. fx_divf16 gives that ratio as a 1/65536 fraction for
+// fx_mulh16x16(), 16 quotient bits where the 32bit __aldiv takes 32.
+// period_rpm() does the same for the 9bit rpm (24/24 __aldiv ~800cy).
+//-------------------------------
+#define RCP(i)              (uint16_t) (0x80000000UL / (0x8000UL + (i) * 1024 + 512))  //2^31 / mid of 32 steps of [0.5, 1)
+
+const uint16_t rcp_table[32] = {
+    RCP(0), RCP(1), RCP(2), RCP(3), RCP(4), RCP(5), RCP(6), RCP(7), RCP(8), RCP(9), RCP(10), RCP(11), RCP(12), RCP(13), RCP(14), RCP(15),
+    RCP(16), RCP(17), RCP(18), RCP(19), RCP(20), RCP(21), RCP(22), RCP(23), RCP(24), RCP(25), RCP(26), RCP(27), RCP(28), RCP(29), RCP(30), RCP(31)
+};
+
+//-------------------------------
+// rpm x TPS ignition map
+// IG_MAP_2D 1: ig_map_2d is used instead of the switch curve of calc_map().
+// Angle in 0.1deg BTDC at ig_rpm_axis (map bins) x ig_tps_axis (TPS 0-255).
+// Bilinear interpolation is split:
+//   TPS:  once per TPS change in the main loop, into ig_col[] (*100deg)
+//   rpm:  once per revolution in stage 2, ig_map_wait() at rpm
+// ig_col[] is double buffered. The main loop fills the one the ISR does not
+// read and then switches ig_map_sel (one byte), so the ISR never reads a half
+// written column.
+// Two maps are blended by the pot on ANC6: 0 = map 0, 255 = map 1.
+// RC6 is SW2 pin 1 (MAXAD_1) and the board has no free analog pin, so the
+// pot needs a board rework: SW2 removed (sw2_pos then reads 2 or 3) and the
+// pot wiper wired to the RC6 side of SW2 pin 1. POT_ENABLE 1 is for that
+// board only. With 0, RC6 stays the SW2 input and pot stays 0 (map 0).
+// A new pass starts when TPS has moved IG_TPS_DEADBAND, the pot POT_DEADBAND,
+// or the table was rewritten.
+//-------------------------------
+#define IG_MAP_2D           (1)     //1:rpm x TPS map 0:switch curve
+#define POT_ENABLE          (0)     //1:Enable (reworked board) 0:Disable
+#define IG_RPM_SIZE         (16)
+#define IG_TPS_SIZE         (8)
+#define IG_TPS_DEADBAND     (2)
+#define POT_DEADBAND        (4)
+
+const uint16_t ig_rpm_axis[IG_RPM_SIZE] = {
+    FIXED_IG_RPM, RPM2BIN(2000), RPM2BIN(2500), RPM2BIN(3000), RPM2BIN(3500), RPM2BIN(4000), RPM2BIN(4500), RPM2BIN(5000),
+    RPM2BIN(5500), RPM2BIN(6000), RPM2BIN(6500), RPM2BIN(7000), RPM2BIN(8000), RPM2BIN(9000), RPM2BIN(11000), MAX_MAP_RPM
+};
+const uint8_t ig_tps_axis[IG_TPS_SIZE] = {0, 16, 32, 64, 96, 128, 192, 255};
+
+//-------------------------------
+// Calibration store
+// Last 9 rows (32 words each) of program flash. Tables here are read as
+// normal const tables (RETLW words) and rewritten by cal_write_row() while
+// the engine is stopped.
+//-------------------------------
+#define CAL_STORE_ADDR      (0x1EE0)
+#define CAL_ROW_SIZE        (32)
+#define PARAM_ADDR          CAL_STORE_ADDR                  //param_flash, 1 row
+#define IG_MAP_ADDR         (CAL_STORE_ADDR + CAL_ROW_SIZE) //ig_map_2d, 8 rows
+#define IG_MAP_BYTES        (2 * IG_TPS_SIZE * IG_RPM_SIZE)
+
+//rpm   1500 2000 2500 3000 3500 4000 4500 5000 5500 6000 6500 7000 8000 9000 11000 16000
+const uint8_t ig_map_2d[2][IG_TPS_SIZE][IG_RPM_SIZE] __at(IG_MAP_ADDR) = {
+    {
+    {50, 80, 120, 160, 190, 200, 200, 200, 200, 190, 170, 150, 120, 100, 100, 100}, //TPS 0
+    {50, 80, 120, 160, 190, 200, 200, 200, 200, 190, 170, 150, 120, 100, 100, 100}, //TPS 16
+    {50, 80, 115, 150, 180, 190, 190, 190, 190, 180, 160, 140, 115, 100, 100, 100}, //TPS 32
+    {50, 75, 110, 140, 170, 180, 180, 180, 180, 170, 150, 130, 110, 95, 95, 95}, //TPS 64
+    {50, 70, 100, 130, 160, 170, 170, 170, 170, 160, 140, 120, 105, 90, 90, 90}, //TPS 96
+    {50, 70, 100, 130, 150, 160, 160, 160, 160, 150, 130, 115, 100, 90, 90, 90}, //TPS 128
+    {50, 70, 95, 125, 145, 155, 155, 155, 155, 145, 125, 110, 100, 90, 90, 90}, //TPS 192
+    {50, 70, 95, 125, 145, 155, 155, 155, 155, 145, 125, 110, 100, 90, 90, 90} //TPS 255
+    },
+    {
+    {60, 100, 150, 190, 220, 230, 230, 230, 230, 220, 200, 180, 150, 120, 120, 120}, //TPS 0
+    {60, 100, 150, 190, 220, 230, 230, 230, 230, 220, 200, 180, 150, 120, 120, 120}, //TPS 16
+    {60, 100, 145, 180, 210, 220, 220, 220, 220, 210, 190, 170, 140, 120, 120, 120}, //TPS 32
+    {60, 95, 135, 170, 200, 210, 210, 210, 210, 200, 180, 160, 135, 115, 115, 115}, //TPS 64
+    {60, 90, 125, 160, 190, 200, 200, 200, 200, 190, 170, 150, 130, 110, 110, 110}, //TPS 96
+    {60, 90, 125, 160, 180, 190, 190, 190, 190, 180, 160, 145, 125, 110, 110, 110}, //TPS 128
+    {60, 90, 120, 155, 175, 185, 185, 185, 185, 175, 155, 140, 125, 110, 110, 110}, //TPS 192
+    {60, 90, 120, 155, 175, 185, 185, 185, 185, 175, 155, 140, 125, 110, 110, 110} //TPS 255
+    }
+};
+
+#if ((IG_TPS_SIZE * IG_RPM_SIZE) % CAL_ROW_SIZE) || (IG_MAP_ADDR + IG_MAP_BYTES > 0x2000) || (IG_MAP_BYTES > 256)
+#error "ig_map_2d must fill whole flash rows in program memory"
+#endif
+
+//-------------------------------
+// Runtime parameters
+// param is the RAM copy of param_flash (first calibration store row). It is
+// loaded at boot, defaults from the #defines when version, sum or a range
+// does not match. It is edited over UART, one command per line:
+//   P<n>=<v>  set word n (1 to PARAM_WORDS - 2) in param_min..param_max
+//   P<n>      read word n. Both answer P<n>=<value now>
+//   PS        save to flash (engine stopped only). Answers PS=0 done, 1 refused
+//   PB        reset into the UART bootloader (engine stopped only). Answers
+//             PB=0 and resets, PB=1 refused. See YZ_CDI_BOOT/boot.c
+//   M<i>=<v>  set ig_map_2d byte i (0 to IG_MAP_BYTES - 1, [map][TPS][rpm]
+//             order) to v (0.1deg, 0-255). Its row is written to flash at
+//             once (engine stopped only) and the maps are rebuilt
+//   M<i>      read byte i. Both answer M<i>=<value in flash>, an index out
+//             of range is ignored
+// An edit only sets param_dirty. param_update() in the main loop derives
+// what the ISR reads: limitter L/H bins, H as PU1 period per TMR1 prescale
+// (the ISR cuts on the raw period, no rpm), quick shifter bin, power jet
+// ticks, and rebuilds the maps for pu1_deg. Never per revolution.
+// FIXED_IG_RPM, MAX_MAP_RPM, PU2_deg and t1_ps_rpm_num size tables or are
+// in compile time checks, so they stay #defines. Limitter and quick shifter
+// tables keep the rpm steps they were converted at.
+//-------------------------------
+#define PARAM_VER           (1)
+#define PARAM_WORDS         (sizeof (PARAM_BLOCK) / 2)
+#define PARAM_REVLIMIT      (REVLIMIT_H * RPM_BIN_WIDTH)
+#define PARAM_LAUNCH        (LAUNCH_H * RPM_BIN_WIDTH)
+#define PARAM_QS_MIN        (QS_MIN_RPM * RPM_BIN_WIDTH)
+#define PARAM_DEFAULT       {PARAM_VER, PARAM_REVLIMIT, PARAM_LAUNCH, PARAM_QS_MIN, PWJ_HOLD_MS, PU1_deg, \
+                            (uint16_t) (0x10000UL - ((PARAM_VER + PARAM_REVLIMIT + PARAM_LAUNCH + PARAM_QS_MIN + PWJ_HOLD_MS + PU1_deg) & 0xFFFF))}
+
+const PARAM_BLOCK param_default = PARAM_DEFAULT;
+const PARAM_BLOCK param_flash __at(PARAM_ADDR) = PARAM_DEFAULT;
+//                            ver     revlimit launch  qs_min  pwj_hold pu1_deg sum
+const uint16_t param_min[] = {0,      3000,    3000,   PARAM_QS_MIN, 0, 3000,   0};
+const uint16_t param_max[] = {0xFFFF, MAX_MAP_RPM * RPM_BIN_WIDTH, MAX_MAP_RPM * RPM_BIN_WIDTH, MAX_MAP_RPM * RPM_BIN_WIDTH, 2000, 4000, 0xFFFF};
+
 //-------------------------------
 // Ignition map
-// map No. 0  1   2 ... 15   16   17 ... 130 
-// rpm     0 100 200...1500 1600 1700...13000(max)
-// Ig_table is shown in BTDC angle. At PU1 input, "rpm" is calculated during interruput sub.
-// And ignition timing(angle) is read from IG_table based on that rpm.
-// Ignition timing angle is then converted to the waiting time from PU1.
-//-------------------------------
-uint16_t IG_table[131] = {0x0000};
-uint8_t deg_table[131] = {0x00};
-uint24_t deg2time_coeff[131] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2276, 2133, 2008, 1896, 1796,
-    1707, 1625, 1552, 1484, 1422, 1365, 1313, 1264, 1219, 1177, 1138, 1101, 1067, 1034, 1004, 975, 948, 923, 898, 875,
-    853, 833, 813, 794, 776, 759, 742, 726, 711, 697, 683, 669, 656, 644, 632, 621, 610, 599, 589, 579,
-    569, 560, 551, 542, 533, 525, 517, 509, 502, 495, 488, 481, 474, 468, 461, 455, 449, 443, 438, 432,
-    427, 421, 416, 411, 406, 402, 397, 392, 388, 384, 379, 375, 371, 367, 363, 359, 356, 352, 348, 345,
-    341, 338, 335, 331, 328, 325, 322, 319, 316, 313, 310, 308, 305, 302, 299, 297, 294, 292, 289, 287,
-    284, 282, 280, 278, 275, 273, 271, 269, 267, 265, 263
+// map No. 0  1   2 ... 30   31   32 ... 320
+// rpm     0  50 100...1500 1550 1600...16000(max)   (RPM_BIN_WIDTH = 50)
+// At PU1 input, "rpm" is calculated during interruput sub. Stage 2 takes
+// the ignition timing (angle) of that bin from the cranking map, ig_col[] or
+// the switch curve and converts it to the waiting time from PU1
+// (ig_map_wait()). No waiting time table is kept: 321 bins would take 642
+// bytes of the 1024 byte RAM.
+// deg2time_coeff is placed in flash and generated for RPM_BIN_WIDTH by D2T().
+// Under 100rpm D2T() does not fit 16bit and is 0 (not used).
+//-------------------------------
+#define D2T(n)  (((n) * RPM_BIN_WIDTH >= 100) ? (uint16_t) ((DEG2TIME_NUM + ((n) * RPM_BIN_WIDTH) / 2) / ((n) * RPM_BIN_WIDTH)) : 0)
+
+#if MAP_SIZE > 321
+#error "deg2time_coeff covers map No. 0-320 only"
+#endif
+
+const uint16_t deg2time_coeff[] = {
+    D2T(0), D2T(1), D2T(2), D2T(3), D2T(4), D2T(5), D2T(6), D2T(7), D2T(8), D2T(9),
+    D2T(10), D2T(11), D2T(12), D2T(13), D2T(14), D2T(15), D2T(16), D2T(17), D2T(18), D2T(19),
+    D2T(20), D2T(21), D2T(22), D2T(23), D2T(24), D2T(25), D2T(26), D2T(27), D2T(28), D2T(29),
+    D2T(30), D2T(31), D2T(32), D2T(33), D2T(34), D2T(35), D2T(36), D2T(37), D2T(38), D2T(39),
+    D2T(40), D2T(41), D2T(42), D2T(43), D2T(44), D2T(45), D2T(46), D2T(47), D2T(48), D2T(49),
+    D2T(50), D2T(51), D2T(52), D2T(53), D2T(54), D2T(55), D2T(56), D2T(57), D2T(58), D2T(59),
+    D2T(60), D2T(61), D2T(62), D2T(63), D2T(64), D2T(65), D2T(66), D2T(67), D2T(68), D2T(69),
+    D2T(70), D2T(71), D2T(72), D2T(73), D2T(74), D2T(75), D2T(76), D2T(77), D2T(78), D2T(79),
+    D2T(80), D2T(81), D2T(82), D2T(83), D2T(84), D2T(85), D2T(86), D2T(87), D2T(88), D2T(89),
+    D2T(90), D2T(91), D2T(92), D2T(93), D2T(94), D2T(95), D2T(96), D2T(97), D2T(98), D2T(99),
+    D2T(100), D2T(101), D2T(102), D2T(103), D2T(104), D2T(105), D2T(106), D2T(107), D2T(108), D2T(109),
+    D2T(110), D2T(111), D2T(112), D2T(113), D2T(114), D2T(115), D2T(116), D2T(117), D2T(118), D2T(119),
+    D2T(120), D2T(121), D2T(122), D2T(123), D2T(124), D2T(125), D2T(126), D2T(127), D2T(128), D2T(129),
+    D2T(130), D2T(131), D2T(132), D2T(133), D2T(134), D2T(135), D2T(136), D2T(137), D2T(138), D2T(139),
+    D2T(140), D2T(141), D2T(142), D2T(143), D2T(144), D2T(145), D2T(146), D2T(147), D2T(148), D2T(149),
+    D2T(150), D2T(151), D2T(152), D2T(153), D2T(154), D2T(155), D2T(156), D2T(157), D2T(158), D2T(159),
+    D2T(160), D2T(161), D2T(162), D2T(163), D2T(164), D2T(165), D2T(166), D2T(167), D2T(168), D2T(169),
+    D2T(170), D2T(171), D2T(172), D2T(173), D2T(174), D2T(175), D2T(176), D2T(177), D2T(178), D2T(179),
+    D2T(180), D2T(181), D2T(182), D2T(183), D2T(184), D2T(185), D2T(186), D2T(187), D2T(188), D2T(189),
+    D2T(190), D2T(191), D2T(192), D2T(193), D2T(194), D2T(195), D2T(196), D2T(197), D2T(198), D2T(199),
+    D2T(200), D2T(201), D2T(202), D2T(203), D2T(204), D2T(205), D2T(206), D2T(207), D2T(208), D2T(209),
+    D2T(210), D2T(211), D2T(212), D2T(213), D2T(214), D2T(215), D2T(216), D2T(217), D2T(218), D2T(219),
+    D2T(220), D2T(221), D2T(222), D2T(223), D2T(224), D2T(225), D2T(226), D2T(227), D2T(228), D2T(229),
+    D2T(230), D2T(231), D2T(232), D2T(233), D2T(234), D2T(235), D2T(236), D2T(237), D2T(238), D2T(239),
+    D2T(240), D2T(241), D2T(242), D2T(243), D2T(244), D2T(245), D2T(246), D2T(247), D2T(248), D2T(249),
+    D2T(250), D2T(251), D2T(252), D2T(253), D2T(254), D2T(255), D2T(256), D2T(257), D2T(258), D2T(259),
+    D2T(260), D2T(261), D2T(262), D2T(263), D2T(264), D2T(265), D2T(266), D2T(267), D2T(268), D2T(269),
+    D2T(270), D2T(271), D2T(272), D2T(273), D2T(274), D2T(275), D2T(276), D2T(277), D2T(278), D2T(279),
+    D2T(280), D2T(281), D2T(282), D2T(283), D2T(284), D2T(285), D2T(286), D2T(287), D2T(288), D2T(289),
+    D2T(290), D2T(291), D2T(292), D2T(293), D2T(294), D2T(295), D2T(296), D2T(297), D2T(298), D2T(299),
+    D2T(300), D2T(301), D2T(302), D2T(303), D2T(304), D2T(305), D2T(306), D2T(307), D2T(308), D2T(309),
+    D2T(310), D2T(311), D2T(312), D2T(313), D2T(314), D2T(315), D2T(316), D2T(317), D2T(318), D2T(319),
+    D2T(320)
 };
 
 //-------------------------------
 // global variables
 //-------------------------------
-uint8_t rpm = 0;
-uint8_t orev_counter = 0;
-uint16_t ig_counter = 0;
-uint16_t t1_count = 0;
+volatile uint16_t rpm = 0;
+uint8_t revlimit_acc = 0;
+volatile uint8_t launch_state = LAUNCH_DISABLE;
+uint8_t launch_lockout = 0;        //Revolutions until LAUNCH_SW IOC is enabled again
+uint8_t qs_cut = 0;                //Quick shifter. Revolutions left to cut
+uint8_t qs_lock = 0;               //Quick shifter. Revolutions left until next shift is accepted
+volatile uint16_t ig_counter = 0;
+volatile uint16_t t1_count = 0;
 uint16_t pu1_2_period_count = 0;
+uint24_t ig_seg = 0;                //PU1-PU2 segment as full period (counts of t1_ps). 0:not valid
+uint24_t ig_tbin = 0;               //Period of bin rpm (counts of t1_ps)
+uint16_t t1_lat = 0;                //PU1 capture to TMR1 restart of this period (counts of t1_ps_old)
+uint16_t ig_next = 0;               //Compare of next PU1 (counts of t1_ps_next)
+int16_t ig_next_add = 0;            //Rev limit + transient of ig_next (0.125us)
+uint8_t ig_next_arm = 0;            //1:Arm ig_next at next PU1
+uint8_t ig_next_map = 0;            //1:ig_next is from a map bin (ig_seg applies)
+uint8_t ig_next_igen = IG_ENABLE;   //IGEN from next PU1
+uint8_t ig_stage2 = 0;              //1:ig_pipeline() pending for this period
+uint8_t pu1_resync = 0;             //1:Implausible period at last PU1
+volatile uint8_t t1_ovf = 0;        //TMR1 overflow count in current revolution
+volatile uint8_t t1_ovf_cap = 0;    //TMR1 overflow count of last captured period
+volatile uint8_t t1_ps = 0;         //TMR1 prescaler stage of t1_count and ig_counter
+uint8_t t1_ps_next = 0;             //TMR1 prescaler stage applied at next PU1
+uint8_t t1_ps_old = 0;              //TMR1 prescaler stage of last period
+uint16_t pu1_blank = 0;             //PU1 blanking window (TMR1 counts). 0:no blanking
+uint24_t pu1_long = 0xFFFFFF;       //PU1 implausible period (TMR1 counts). 0xFFFFFF:no limit
+uint16_t pu1_noise_cnt = 0;         //PU1 edges discarded in blanking window
+uint16_t pu1_resync_cnt = 0;        //PU1 implausible periods
 uint8_t map_sel = 0;
-uint8_t EG_state = 0;
+volatile uint8_t EG_state = EG_STOPPED;
+uint16_t eg_trans_cnt = 0;          //Engine state transitions
+volatile uint8_t ig_map_ready = 0;  //1:Maps built at boot. Digital ignition from then on
+uint16_t boot_ticks = 0;            //initialize_ignition() to ig_map_ready (32us)
+uint8_t eg_bad = 0;                 //Implausible PU1 periods in a row
+uint8_t eg_good = 0;                //Plausible PU1 periods in a row in EG_LIMP
+uint8_t limp_pu2 = 0;               //1:PU1 lost. TMR1 and spark referenced to PU2
+uint8_t pu1_seen = 0;               //PU1 edges since last PU2 (PU2 limp)
+uint8_t limp_good = 0;              //PU2 periods in a row with one PU1 (PU2 limp)
 uint8_t revlimit_state = 0;
 uint8_t pwj_state = 0;
-const uint16_t numerator_rpm = 37500;
+uint8_t pwj_duty = 0;               //Power jet duty applied to PWM3
+uint8_t pwj_req = 0;                //Power jet duty requested by the table
+uint16_t pwj_req_tick = 0;          //Tick when pwj_req has changed
+volatile uint8_t tps = 0;           //Throttle position 0-255. Written by ADC ISR
+uint16_t tps_buf[TPS_BUF_SIZE] = {0}; //TPS ring buffer (10bit)
+uint16_t tps_sum = 0;               //Sum of tps_buf
+uint8_t trans_rev = 0;              //Revolutions left of throttle transient correction
+uint8_t adc_ch = ADC_TPS;           //Channel of next ADC conversion
+uint8_t adc_tmr2_ch = ADC_TPS;      //Channel converted by TMR2 trigger (TPS or pot)
+uint8_t adc_seq = 0;                //TPS conversions since last pot conversion
+volatile uint8_t pot = 0;           //Map blend pot 0-255. Written by ADC ISR
+uint8_t tps_idx = 0;                //Oldest sample in tps_buf
+uint8_t ypvs_pos = 0;               //Power valve position on PWM4. 0:closed 255:full open
+uint8_t ypvs_clean = YPVS_CLEAN_CYCLES * 2; //Cleaning sweep strokes left
+uint16_t ypvs_tick = 0;             //Tick of last ypvs_update() step
 uint8_t sw1_pos = 2;
 uint8_t sw2_pos = 3;
 uint8_t sw3_pos = 3;
 uint8_t sw4_pos = 3;
-uint16_t tx_buf[6] = {0x0000};
+#define TX_BUF_SIZE (12)
+uint16_t tx_buf[TX_BUF_SIZE] = {0x0000};
+#if IG_MAP_2D
+int16_t ig_col[2][IG_RPM_SIZE] = {0}; //ig_map_2d interpolated at ig_map_tps (*100deg). ISR reads [ig_map_sel]
+uint16_t ig_rpm_rcp[IG_RPM_SIZE - 1] = {0}; //65536 / bins of each ig_rpm_axis segment
+#else
+IG_CURVE ig_curve[2];               //Switch curve. ISR reads [ig_map_sel]
+#endif
+volatile uint8_t ig_map_sel = 0;    //Map buffer the ISR reads. The main loop writes the other one
+uint8_t ig_map_tps = 0;             //TPS of ig_col[]
+uint8_t ig_map_pot = 0;             //Blend pot of ig_col[]
+uint8_t ig_map_dirty = 0;           //1:ig_map_2d was rewritten (switch curve: switches changed)
+uint8_t ig_map_sw = 0;              //Switch positions of the switch curve in ig_curve[]
+PARAM_BLOCK param;                  //Runtime parameters (RAM copy of param_flash)
+uint8_t param_dirty = 0;            //1:param was edited, derived values are old
+uint16_t param_pu1_deg = PU1_deg;   //pu1_deg the ISR converts the map angle with
+uint8_t pu12_seg_mul = 36000 / (PU1_deg - PU2_deg);    //Full period / PU1-PU2 segment, integer part
+uint16_t pu12_seg_frac = 0;         //Fraction of it (1/65536)
+uint16_t revlimit_l_bin[2] = {REVLIMIT_L, LAUNCH_L};    //Limitter L (map bins)
+uint16_t revlimit_h_bin[2] = {REVLIMIT_H, LAUNCH_H};    //Limitter H (map bins)
+uint16_t revlimit_h_period[2][T1_PS_STAGES] = {0};      //Limitter H as PU1 period (TMR1 counts). 0:none yet
+uint16_t qs_min_bin = QS_MIN_RPM;   //Quick shifter ignored under this (map bins)
+uint16_t pwj_hold_tick = TICK_MS(PWJ_HOLD_MS);
+#define RX_BUF_SIZE (16)
+uint8_t rx_buf[RX_BUF_SIZE];        //UART receive ring (ISR -> main loop)
+uint8_t rx_head = 0;
+uint8_t rx_tail = 0;
+uint8_t rx_state = 0;               //Command parse. 0:line start 1:'P' 2:n 3:v 4:'S' 5:skip line 6:'B' 7:'M' 8:i 9:v 10:bad v
+uint8_t rx_n = 0;                   //Word number (P) or map byte (M) of command
+uint24_t rx_v = 0;                  //Value of command
+volatile ENGINE_SNAPSHOT eg_snap = {0};   //Written by ISR only
+ENGINE_SNAPSHOT eg_view = {0};            //Main loop copy of eg_snap
 
 //-------------------------------
 // main
 //-------------------------------
 
 void main() {
-    initialize_system();
-    IGEN = IG_ENABLE;
-    check_sw_state();
-    calc_map();
-    ccp1_enable();
-    ccp2_disable();
+    boot();
     while (1) {
-        check_sw_state();
-        Write_table();
+        if (main_pass()) Write_table();
     }
 }
 
+//-------------------------------
+// Boot
+// PU1 capture first, then the maps, then the main loop peripherals.
+// BOOT_MAP_HOOK() is empty on target, the host simulator spends the
+// calc_map() time there.
+//-------------------------------
+#ifndef BOOT_MAP_HOOK
+#define BOOT_MAP_HOOK()
+#endif
+
+void boot(void) {
+    initialize_ignition();
+    param_load();
+    param_update();
+    check_sw_state();
+    BOOT_MAP_HOOK();
+    calc_map();
+    boot_ticks = get_tick();
+    ig_map_ready = 1;
+    initialize_system();
+}
+
+//-------------------------------
+// Main loop pass
+// Returns 0 while stopped, switches are not scanned and no telemetry is due
+//-------------------------------
+
+uint8_t main_pass(void) {
+    read_snapshot();
+    param_rx();
+    if (param_dirty) param_update();
+    pwj_update();
+#if YPVS_ENABLE
+    ypvs_update();
+#endif
+#if IG_MAP_2D
+    ig_map_update();
+#else
+    if (ig_map_dirty) calc_map();
+#endif
+    if (eg_view.EG_state == EG_STOPPED) return 0;
+    check_sw_state();
+    return 1;
+}
+
 //-------------------------------
 // UART write data table
 //-------------------------------
 
 void Write_table() {
     uint8_t tx_data[8], a;
+    uint16_t wait_deg;
+    uint32_t period;
 
-    tx_buf[0] = rpm;
-    tx_buf[1] = deg_table[rpm];
-    tx_buf[2] = ig_counter;
-    tx_buf[3] = t1_count;
-    tx_buf[4] = PORTAbits.RA0;
-    tx_buf[5] = EG_state;
-    for (a = 0; a <= 5; a++) {
+    //Ignition angle(deg BTDC) back-calculated from waiting time and period
+    period = ((uint32_t) eg_view.t1_ovf << 16) + eg_view.t1_count;
+    wait_deg = 0xFFFF;
+    if (period != 0) {
+        wait_deg = (uint16_t) (((uint32_t) eg_view.ig_counter * 36000) / period);
+    }
+    tx_buf[0] = eg_view.rpm * RPM_BIN_WIDTH;
+    tx_buf[1] = (wait_deg < param_pu1_deg) ? ((param_pu1_deg - wait_deg) / 100) : 0;
+    tx_buf[2] = eg_view.ig_counter;
+    tx_buf[3] = eg_view.t1_count >> t1_ps_shift[eg_view.t1_ps]; //us
+    tx_buf[4] = pwj_duty;
+    tx_buf[5] = eg_view.EG_state;
+    tx_buf[6] = eg_view.pu1_noise_cnt;
+    tx_buf[7] = eg_view.pu1_resync_cnt;
+    tx_buf[8] = tps;
+    tx_buf[9] = pot;
+    tx_buf[10] = eg_view.eg_trans_cnt;
+    tx_buf[11] = boot_ticks;
+    for (a = 0; a < TX_BUF_SIZE; a++) {
         sprintf(tx_data, "%d,", tx_buf[a]);
         WriteString(tx_data);
     }
     WriteString("\r\n");
 }
 
+//-------------------------------
+// Publish engine snapshot (ISR only)
+//-------------------------------
+
+void publish_snapshot(void) {
+    eg_snap.seq++;
+    eg_snap.rpm = rpm;
+    eg_snap.EG_state = EG_state;
+    eg_snap.ig_counter = ig_counter;
+    eg_snap.t1_count = t1_count;
+    eg_snap.t1_ovf = t1_ovf_cap;
+    eg_snap.t1_ps = t1_ps;
+    eg_snap.pu1_noise_cnt = pu1_noise_cnt;
+    eg_snap.pu1_resync_cnt = pu1_resync_cnt;
+    eg_snap.eg_trans_cnt = eg_trans_cnt;
+    eg_snap.seq++;
+}
+
+//-------------------------------
+// Read engine snapshot (main loop)
+// No interrupt disable. Copy is retried if the ISR published meanwhile.
+//-------------------------------
+
+void read_snapshot(void) {
+    uint8_t seq;
+
+    do {
+        seq = eg_snap.seq;
+        eg_view.rpm = eg_snap.rpm;
+        eg_view.EG_state = eg_snap.EG_state;
+        eg_view.ig_counter = eg_snap.ig_counter;
+        eg_view.t1_count = eg_snap.t1_count;
+        eg_view.t1_ovf = eg_snap.t1_ovf;
+        eg_view.t1_ps = eg_snap.t1_ps;
+        eg_view.pu1_noise_cnt = eg_snap.pu1_noise_cnt;
+        eg_view.pu1_resync_cnt = eg_snap.pu1_resync_cnt;
+        eg_view.eg_trans_cnt = eg_snap.eg_trans_cnt;
+    } while ((seq & 0x01) || (seq != eg_snap.seq));
+    eg_view.seq = seq;
+}
+
+//-------------------------------
+// Power jet PWM update (main loop)
+//-------------------------------
+
+void pwj_update(void) {
+    uint8_t duty;
+    uint16_t a, now;
+
+    now = get_tick();
+    if (eg_view.EG_state == EG_STOPPED) {
+        duty = 0;
+        pwj_req = 0;
+        pwj_req_tick = now;
+    } else {
+        a = eg_view.rpm / PWJ_RPM_STEP;
+        if (a >= PWJ_RPM_SIZE) a = PWJ_RPM_SIZE - 1;
+        duty = pwj_duty_table[pwj_state][a][tps >> PWJ_TPS_SHIFT];
+        if (duty != pwj_req) {
+            pwj_req = duty;
+            pwj_req_tick = now;
+            return;
+        }
+        if ((uint16_t) (now - pwj_req_tick) < pwj_hold_tick) return;
+    }
+    if (duty != pwj_duty) {
+        pwj_duty = duty;
+        PWM3DCH = duty;
+        PWM3DCL = 0;
+    }
+}
+
+#if YPVS_ENABLE
+//-------------------------------
+// Power valve servo update (main loop)
+// Runs every YPVS_PERIOD_MS. Odd cleaning strokes close, even ones open.
+//-------------------------------
+
+void ypvs_update(void) {
+    uint8_t target;
+    uint16_t a, r, dc;
+
+    if ((uint16_t) (get_tick() - ypvs_tick) < TICK_MS(YPVS_PERIOD_MS)) return;
+    ypvs_tick += TICK_MS(YPVS_PERIOD_MS);
+
+    if ((ypvs_clean != 0)&&(eg_view.EG_state != EG_STOPPED)) ypvs_clean = 0;
+    if (ypvs_clean != 0) {
+        target = (ypvs_clean & 0x01) ? 0 : 255;
+        if (ypvs_pos == target) ypvs_clean--;
+    } else {
+        a = eg_view.rpm / YPVS_RPM_STEP;
+        if (a >= YPVS_RPM_SIZE - 1) {
+            target = ypvs_pos_table[YPVS_RPM_SIZE - 1];
+        } else {
+            r = eg_view.rpm - a * YPVS_RPM_STEP;
+            target = (uint8_t) (ypvs_pos_table[a] + (((int16_t) ypvs_pos_table[a + 1] - ypvs_pos_table[a]) * (int16_t) r) / YPVS_RPM_STEP);
+        }
+    }
+    //Rate limit
+    if (target > ypvs_pos) {
+        ypvs_pos = ((target - ypvs_pos) > YPVS_RATE) ? ypvs_pos + YPVS_RATE : target;
+    } else if (target < ypvs_pos) {
+        ypvs_pos = ((ypvs_pos - target) > YPVS_RATE) ? ypvs_pos - YPVS_RATE : target;
+    } else {
+        return;
+    }
+    dc = YPVS_PULSE_MIN + ((uint16_t) ypvs_pos * YPVS_PULSE_SPAN) / 255;
+    PWM4DCH = (uint8_t) (dc >> 2);
+    PWM4DCL = (uint8_t) (dc << 6);
+}
+#endif
+
+//-------------------------------
+// Main loop time base read
+// TMR0H is latched when TMR0L is read
+//-------------------------------
+
+uint16_t get_tick(void) {
+    uint8_t l;
+
+    l = TMR0L;
+    return ((uint16_t) TMR0H << 8) | l;
+}
+
+//-------------------------------
+// (a * b) >> 8
+// Shift-add from LSB of b. Adding a (not a << 8) before each shift keeps
+// the sum in 17bit and floors exactly.
+//-------------------------------
+
+uint16_t fx_mulh16x8(uint16_t a, uint8_t b) {
+    uint24_t acc;
+    uint8_t i;
+
+    acc = 0;
+    for (i = 0; i < 8; i++) {
+        if (b & 0x01) acc += a;
+        acc >>= 1;
+        b >>= 1;
+    }
+    return (uint16_t) acc;
+}
+
+//-------------------------------
+// (a * b) >> 16
+//-------------------------------
+
+uint16_t fx_mulh16x16(uint16_t a, uint16_t b) {
+    uint24_t acc;
+    uint8_t i;
+
+    acc = 0;
+    for (i = 0; i < 16; i++) {
+        if (b & 0x01) acc += a;
+        acc >>= 1;
+        b >>= 1;
+    }
+    return (uint16_t) acc;
+}
+
+//-------------------------------
+// 65536 / x
+// x is normalized to [0.5, 1) (x << s, MSB set). y = 2^31 / x from
+// rcp_table, then y += y * (1 - x * y / 2^31).
+//-------------------------------
+
+uint16_t fx_recip16(uint16_t x) {
+    uint8_t s;
+    uint16_t y, p, c;
+
+    if (x < 2) return 0xFFFF;
+    s = 0;
+    while (!(x & 0x8000)) {
+        x <<= 1;
+        s++;
+    }
+    y = rcp_table[(x >> 10) & 0x1F];
+    p = fx_mulh16x16(x, y); //x * y / 2^16, near 0x8000
+    if (p <= 0x8000) {
+        c = fx_mulh16x16(y, (uint16_t) (0x8000 - p) << 1);
+        y = (y > 0xFFFF - c) ? 0xFFFF : y + c;
+    } else {
+        c = fx_mulh16x16(y, (uint16_t) (p - 0x8000) << 1);
+        y -= c;
+    }
+    return y >> (15 - s);
+}
+
+//-------------------------------
+// n x 65536 / d, n < d < 2^23
+// Restoring division of the 16 fraction bits. The remainder stays below d,
+// so it shifts in 24bit.
+//-------------------------------
+
+uint16_t fx_divf16(uint24_t n, uint24_t d) {
+    uint16_t q;
+    uint8_t i;
+
+    q = 0;
+    for (i = 0; i < 16; i++) {
+        n <<= 1;
+        q <<= 1;
+        if (n >= d) {
+            n -= d;
+            q |= 0x01;
+        }
+    }
+    return q;
+}
+
+//-------------------------------
+// a + b saturated to 0..0xFFFF
+//-------------------------------
+
+uint16_t fx_adds16(uint16_t a, int16_t b) {
+    if (b < 0) return ((uint16_t) -b > a) ? 0 : a - (uint16_t) -b;
+    return (a > 0xFFFF - (uint16_t) b) ? 0xFFFF : a + (uint16_t) b;
+}
+
 //-------------------------------
 // UART write 1byte
 //-------------------------------
@@ -212,55 +1224,315 @@ void WriteString(const char *str) {
     }
 }
 
+#if IG_MAP_2D
+//-------------------------------
+// Calculate ignition map (rpm x TPS)
+// Segment reciprocals of ig_rpm_axis and ig_col[] at current TPS. Used at
+// start up.
+//-------------------------------
+
+void calc_map() {
+    uint8_t i;
+
+    for (i = 0; i < IG_RPM_SIZE - 1; i++) {
+        ig_rpm_rcp[i] = fx_recip16(ig_rpm_axis[i + 1] - ig_rpm_axis[i]);
+    }
+    ig_map_tps = tps;
+    ig_map_pot = pot;
+    ig_map_col();
+}
+
+//-------------------------------
+// Ignition map background update (main loop)
+//-------------------------------
+
+void ig_map_update(void) {
+    uint8_t t, p;
+
+    t = tps;
+    p = pot;
+    if ((!ig_map_dirty)&&(((t > ig_map_tps) ? (t - ig_map_tps) : (ig_map_tps - t)) < IG_TPS_DEADBAND)
+            &&(((p > ig_map_pot) ? (p - ig_map_pot) : (ig_map_pot - p)) < POT_DEADBAND)) return;
+    ig_map_dirty = 0;
+    ig_map_tps = t;
+    ig_map_pot = p;
+    ig_map_col();
+}
+
 //-------------------------------
-// Calculate ignition map
+// Interpolate both maps along TPS and blend them by pot into ig_col[]
+// Written to the buffer the ISR does not read, which is then switched.
+//-------------------------------
+
+void ig_map_col(void) {
+    uint8_t i, k, dt, ft;
+    int24_t d, c0, c1;
+    int16_t *c;
+
+    c = ig_col[ig_map_sel ^ 1];
+    k = 0;
+    while ((k < IG_TPS_SIZE - 2)&&(ig_map_tps > ig_tps_axis[k + 1])) k++;
+    dt = ig_tps_axis[k + 1] - ig_tps_axis[k];
+    ft = ig_map_tps - ig_tps_axis[k];
+    for (i = 0; i < IG_RPM_SIZE; i++) {
+        d = ((int24_t) ig_map_2d[0][k + 1][i] - ig_map_2d[0][k][i]) * 10;
+        c0 = ig_map_2d[0][k][i] * 10 + (d * ft) / dt;
+        d = ((int24_t) ig_map_2d[1][k + 1][i] - ig_map_2d[1][k][i]) * 10;
+        c1 = ig_map_2d[1][k][i] * 10 + (d * ft) / dt;
+        c[i] = (int16_t) (c0 + ((c1 - c0) * ig_map_pot) / 255);
+    }
+    ig_map_sel ^= 1;
+}
+#else
+//-------------------------------
+// Calculate ignition map (switch curve, main loop)
+// Runs at boot and from the main loop when the switches have changed, also
+// while running. The break points are written to the ig_curve[] buffer the
+// ISR does not read, which is then switched.
 //-------------------------------
 
 void calc_map() {
-    uint8_t p1x, p2x, p3x, p4x;
-    uint16_t p1y, p2y, p3y, p4y;
-    uint8_t coeff_p1_p2, coeff_p3_p4;
+    IG_CURVE *c;
+
+    ig_map_dirty = 0;
+    ig_map_sw = (uint8_t) ((sw1_pos << 6) | (sw2_pos << 4) | (sw3_pos << 2) | sw4_pos);
+    c = &ig_curve[ig_map_sel ^ 1];
+    c->p1x = RPM100_2BIN(adv_start_rpm_table[sw1_pos]);
+    c->p2x = RPM100_2BIN(adv_start_rpm_table[sw1_pos] + max_adv_grad_table[sw3_pos]);
+    c->p3x = RPM100_2BIN(Ret_start_rpm);
+    c->p4x = RPM100_2BIN(Ret_end_rpm);
+    c->p1y = PU2_deg;
+    c->p3y = max_adv_table[sw2_pos];
+    c->p4y = min_ret_table[sw4_pos];
+    //Gradient per bin in 1/256 deg*100, so narrow bins do not accumulate truncation error.
+    //Signed: min_ret_table can be above max_adv_table on some switch positions.
+    c->slope1 = (int16_t) ((((int24_t) c->p3y - (int24_t) c->p1y) * 256) / (int24_t) (c->p2x - c->p1x));
+    c->slope2 = (int16_t) ((((int24_t) c->p4y - (int24_t) c->p3y) * 256) / (int24_t) (c->p4x - c->p3x));
+    ig_map_sel ^= 1;
+}
+#endif
+
+//-------------------------------
+// Calibration store row write
+// Erase one row at addr (row aligned) and write n bytes of data as RETLW
+// words. The rest of the row is left erased.
+// The CPU stalls during erase and write, so it is refused while running.
+// Returns 0:done 1:refused or write error
+//-------------------------------
+
+uint8_t cal_write_row(uint16_t addr, const uint8_t *data, uint8_t n) {
     uint8_t a;
-    uint24_t temp;
-    uint24_t temp1;
 
-    p1x = adv_start_rpm_table[sw1_pos];
-    p2x = adv_start_rpm_table[sw1_pos] + max_adv_grad_table[sw3_pos];
-    p3x = Ret_start_rpm;
-    p4x = Ret_end_rpm;
-    p1y = PU2_deg;
-    p2y = max_adv_table[sw2_pos];
-    p3y = p2y;
-    p4y = min_ret_table[sw4_pos];
-    coeff_p1_p2 = (uint8_t) ((p2y - p1y) / (p2x - p1x));
-    coeff_p3_p4 = (uint8_t) ((p3y - p4y) / (p4x - p3x));
+    if (EG_state != EG_STOPPED) return 1;
+    NVMADR = addr;
+    NVMCON1 = 0b00010100; //FREE, WREN: row erase
+    nvm_unlock();
+    NVMCON1 = 0b00100100; //LWLO, WREN: load write latches
+    for (a = 0; a < CAL_ROW_SIZE; a++) {
+        NVMADR = addr + a;
+        NVMDAT = (a < n) ? (0x3400 | data[a]) : 0x3FFF; //RETLW data[a]
+        if (a == CAL_ROW_SIZE - 1) NVMCON1bits.LWLO = 0; //Last word starts row write
+        nvm_unlock();
+    }
+    NVMCON1bits.WREN = 0;
+    if (NVMCON1bits.WRERR) return 1;
+    if ((addr >= IG_MAP_ADDR)&&(addr < IG_MAP_ADDR + IG_MAP_BYTES)) ig_map_dirty = 1;
+    return 0;
+}
+
+//-------------------------------
+// NVM unlock sequence and start
+//-------------------------------
+
+void nvm_unlock(void) {
+    GIE = 0;
+    NVMCON2 = 0x55;
+    NVMCON2 = 0xAA;
+    NVMCON1bits.WR = 1;
+    NOP();
+    NOP();
+    GIE = 1;
+}
+
+//-------------------------------
+// Runtime parameter load (boot)
+// param_flash if version, sum and ranges are good, else defaults
+//-------------------------------
 
-    //calc iginition timing (deg)
-    for (a = 15; a <= p1x; a++) {
-        IG_table[a] = p1y;
+void param_load(void) {
+    uint8_t a, bad;
+    uint16_t sum, w;
+
+    sum = 0;
+    bad = 0;
+    for (a = 0; a < PARAM_WORDS; a++) {
+        w = ((const uint16_t *) &param_flash)[a];
+        ((uint16_t *) &param)[a] = w;
+        sum += w;
+        if ((w < param_min[a]) || (w > param_max[a])) bad = 1;
     }
-    for (a = p1x + 1; a <= p2x; a++) {
-        IG_table[a] = coeff_p1_p2 + IG_table[a - 1];
+    if ((bad) || (param.ver != PARAM_VER) || (sum != 0)) param = param_default;
+    param_dirty = 1;
+}
+
+//-------------------------------
+// Runtime parameter derived values (main loop)
+// Each value the ISR reads is stored with interrupts off.
+//-------------------------------
+
+void param_update(void) {
+    uint8_t a, s;
+    uint16_t h, p;
+    uint32_t us;
+
+    param_dirty = 0;
+    for (a = 0; a < 2; a++) {
+        h = RPM2BIN((a == REVLIMIT_LAUNCH) ? param.launch_rpm : param.revlimit_rpm);
+        us = 60000000UL / ((uint32_t) h * RPM_BIN_WIDTH); //PU1 period at H (us)
+        GIE = 0;
+        revlimit_l_bin[a] = h - REVLIMIT_SIZE * REVLIMIT_STEP;
+        revlimit_h_bin[a] = h;
+        GIE = 1;
+        for (s = 0; s < T1_PS_STAGES; s++) {
+            p = ((us << t1_ps_shift[s]) > 0xFFFF) ? 0xFFFF : (uint16_t) (us << t1_ps_shift[s]);
+            GIE = 0;
+            revlimit_h_period[a][s] = p;
+            GIE = 1;
+        }
     }
-    for (a = p2x + 1; a <= p3x; a++) {
-        IG_table[a] = p3y;
+    h = RPM2BIN(param.qs_min_rpm);
+    GIE = 0;
+    qs_min_bin = h;
+    GIE = 1;
+    pwj_hold_tick = TICK_MS(param.pwj_hold_ms);
+
+    //New PU1 angle: segment multiplier, waiting times from next revolution
+    if (param.pu1_deg != param_pu1_deg) {
+        h = param.pu1_deg - PU2_deg;
+        p = (uint16_t) ((((uint32_t) (36000 % h)) << 16) / h);
+        GIE = 0;
+        param_pu1_deg = param.pu1_deg;
+        pu12_seg_mul = (uint8_t) (36000 / h);
+        pu12_seg_frac = p;
+        GIE = 1;
     }
-    for (a = p3x + 1; a <= p4x; a++) {
-        IG_table[a] = IG_table[a - 1] - coeff_p3_p4;
+}
+
+//-------------------------------
+// Runtime parameter UART receive (main loop)
+// Parses the receive ring one character at a time
+//-------------------------------
+
+void param_rx(void) {
+    uint8_t c;
+
+    while (rx_tail != rx_head) {
+        c = rx_buf[rx_tail];
+        rx_tail = (rx_tail + 1) & (RX_BUF_SIZE - 1);
+        if ((c == '\r') || (c == '\n')) {
+            if (rx_state >= 2) param_cmd();
+            rx_state = 0;
+        } else if ((rx_state == 0)&&(c == 'P')) {
+            rx_state = 1;
+            rx_n = 0;
+            rx_v = 0;
+        } else if ((rx_state == 0)&&(c == 'M')) {
+            rx_state = 7;
+            rx_n = 0;
+            rx_v = 0;
+        } else if (((rx_state == 7) || (rx_state == 8))&&(c >= '0')&&(c <= '9')) {
+            rx_v = rx_v * 10 + (c - '0'); //Map byte, to rx_n when complete
+            rx_state = (rx_v < IG_MAP_BYTES) ? 8 : 5;
+        } else if ((rx_state == 8)&&(c == '=')) {
+            rx_state = 9;
+            rx_n = (uint8_t) rx_v;
+            rx_v = 0;
+        } else if ((rx_state == 9)&&(c >= '0')&&(c <= '9')) {
+            rx_v = rx_v * 10 + (c - '0');
+            if (rx_v > 0xFF) rx_state = 10;
+        } else if (rx_state >= 9) {
+            rx_state = 10;
+        } else if ((rx_state == 1)&&(c == 'S')) {
+            rx_state = 4;
+        } else if ((rx_state == 1)&&(c == 'B')) {
+            rx_state = 6;
+        } else if (((rx_state == 1) || (rx_state == 2))&&(c >= '0')&&(c <= '9')) {
+            rx_n = rx_n * 10 + (c - '0');
+            rx_state = (rx_n < PARAM_WORDS) ? 2 : 5;
+        } else if ((rx_state == 2)&&(c == '=')) {
+            rx_state = 3;
+        } else if ((rx_state == 3)&&(c >= '0')&&(c <= '9')) {
+            rx_v = rx_v * 10 + (c - '0');
+            if (rx_v > 0xFFFF) rx_state = 5;
+        } else {
+            rx_state = 5;
+        }
     }
-    for (a = p4x + 1; a <= 130; a++) {
-        IG_table[a] = p4y;
+}
+
+//-------------------------------
+// Runtime parameter command (main loop)
+//-------------------------------
+
+void param_cmd(void) {
+    uint8_t tx_data[8];
+    uint16_t *w;
+
+    if (rx_state >= 7) {
+        if (rx_state != 7) ig_map_cmd();
+        return;
     }
-    //for debugging
-    for (a = 15; a <= 130; a++) {
-        deg_table[a] = (uint8_t) (IG_table[a] / 100);
+    if (rx_state == 4) {
+        sprintf(tx_data, "PS=%u\r\n", cal_write_row(PARAM_ADDR, (const uint8_t *) &param, sizeof (PARAM_BLOCK)));
+        WriteString(tx_data);
+        return;
+    }
+    if (rx_state == 6) {
+        if (EG_state != EG_STOPPED) {
+            WriteString("PB=1\r\n");
+            return;
+        }
+        WriteString("PB=0\r\n");
+        while (!TRMT);
+        RESET(); //Bootloader sees the RESET instruction reset (nRI)
     }
-    //
-    for (a = 15; a <= 130; a++) {
-        temp1 = ((PU1_deg - IG_table[a]) >> 1);
-        temp = ((deg2time_coeff[a] * temp1) >> 10);
-        IG_table[a] = temp;
+    if ((rx_n == 0) || (rx_n >= PARAM_WORDS - 1)) return;
+    w = (uint16_t *) &param;
+    if ((rx_state == 3)&&(rx_v >= param_min[rx_n])&&(rx_v <= param_max[rx_n])) {
+        param.sum += w[rx_n] - (uint16_t) rx_v;
+        w[rx_n] = (uint16_t) rx_v;
+        param_dirty = 1;
+    }
+    sprintf(tx_data, "P%u=", rx_n);
+    WriteString(tx_data);
+    sprintf(tx_data, "%u\r\n", w[rx_n]);
+    WriteString(tx_data);
+}
+
+//-------------------------------
+// Ignition map UART command (main loop)
+// The flash row of byte rx_n is copied, changed and written back whole.
+// cal_write_row() refuses it while running and sets ig_map_dirty.
+//-------------------------------
+
+void ig_map_cmd(void) {
+    uint8_t tx_data[12];
+    uint8_t row[CAL_ROW_SIZE];
+    const uint8_t *m;
+    uint8_t a, r;
+
+    m = &ig_map_2d[0][0][0];
+    if (rx_state == 8) rx_n = (uint8_t) rx_v;
+    if (rx_state == 9) {
+        r = rx_n & (uint8_t) ~(CAL_ROW_SIZE - 1);
+        for (a = 0; a < CAL_ROW_SIZE; a++) {
+            row[a] = m[r + a];
+        }
+        row[rx_n - r] = (uint8_t) rx_v;
+        cal_write_row(IG_MAP_ADDR + r, row, CAL_ROW_SIZE);
     }
+    sprintf(tx_data, "M%u=%u\r\n", rx_n, m[rx_n]);
+    WriteString(tx_data);
 }
 
 //-------------------------------
@@ -284,12 +1556,40 @@ void check_sw_state() {
         revlimit_state = REVLIMIT_ENABLE;
         break;
     }
+    //Launch switch is read by IOC in ISR while running. Follow the level at boot
+    if (EG_state == EG_STOPPED) {
+        switch (LAUNCH_SW) {
+        case LAUNCH_ACTIVE:
+            launch_state = LAUNCH_ENABLE;
+            break;
+        default:
+            launch_state = LAUNCH_DISABLE;
+            break;
+        }
+    }
 
+    //sw1_pos = (ADST_1 << 1) + ADST_2;
+#if YPVS_ENABLE
+    sw1_pos = (ADST_1 << 1) + 1; //ADST_2 is used for YPVS servo output
+#else
     sw1_pos = (ADST_1 << 1) + ADST_2;
+#endif
+#if POT_ENABLE
+    sw2_pos = (1 << 1) + MAXAD_2; //MAXAD_1 is used for map blend pot
+#else
     sw2_pos = (MAXAD_1 << 1) + MAXAD_2;
+#endif
     //sw3_pos = (GRAD_1 << 1) + GRAD_2;
     sw3_pos = 3; //disable sw3 select for uart 
+#if QS_ENABLE
+    sw4_pos = (ADRV_1 << 1) + 1; //ADRV_2 is used for quick shifter
+#else
     sw4_pos = (ADRV_1 << 1) + ADRV_2;
+#endif
+#if !IG_MAP_2D
+    //Switch curve follows the switches (main loop)
+    if ((uint8_t) ((sw1_pos << 6) | (sw2_pos << 4) | (sw3_pos << 2) | sw4_pos) != ig_map_sw) ig_map_dirty = 1;
+#endif
 }
 
 //-------------------------------
@@ -297,64 +1597,100 @@ void check_sw_state() {
 //-------------------------------
 
 void __interrupt() InterruptManager() {
+    uint8_t a;
+    uint16_t lat;           //PU1 capture to TMR1 restart (counts)
+    uint16_t adc;
+    uint16_t pu2_t;         //TMR1 at ISR entry
+    uint8_t pu2_in;         //1:PU2 edge before ISR entry, pu2_t is its time
+    uint24_t period;
+
+    pu2_t = TMR1;
+    pu2_in = IOCAF2;
+
     //PU1 input change detect
     if (CCP1IF) {
-        if (EG_state == EG_RUN) {
-            TMR1ON = 0;
+        if ((limp_pu2)&&(limp_good < LIMP_EXIT_REV)) {
+            //PU2 limp. PU1 is only counted for health check
+            pu1_seen++;
+        } else if ((EG_state != EG_STOPPED) && (!limp_pu2) && (t1_ovf == 0) && (CCPR1 < pu1_blank)) {
+            //Noise in blanking window. TMR1 keeps running
+            pu1_noise_cnt++;
+        } else if ((EG_state != EG_STOPPED) && (!limp_pu2)) {
+            //Stage 1. Spark of last period never came: stage 2 of it first
+            if (ig_stage2) ig_pipeline();
+            T1CON = t1_ps_con[t1_ps_next]; //TMR1 off and next prescale
+            lat = TMR1 - CCPR1; //Capture to restart delay
+            t1_lat = lat;
             TMR1H = 0x00;
             TMR1L = 0x00;
             TMR1ON = 1;
             ccp1_disable();
             t1_count = CCPR1;
+            //Overflow pending at capture belongs to this period if captured after it
+            if (TMR1IF) {
+                if (t1_count < 0x8000) t1_ovf++;
+                TMR1IF = 0;
+            }
+            t1_ovf_cap = t1_ovf;
+            t1_ovf = 0;
+            period = ((uint24_t) t1_ovf_cap << 16) | t1_count;
+            //Missed edge. Resync to this edge without map ignition
+            pu1_resync = (period > pu1_long);
+            //Limitter H on the raw period cuts this revolution already
+            a = (launch_state == LAUNCH_ENABLE) ? REVLIMIT_LAUNCH : REVLIMIT_MAIN;
+            if (((revlimit_state == REVLIMIT_ENABLE) || (a == REVLIMIT_LAUNCH))&&(t1_ovf_cap == 0)&&(t1_count <= revlimit_h_period[a][t1_ps])) {
+                ig_next_arm = 0;
+                ig_next_igen = IG_DISABLE;
+            }
 
-            rpm = (uint8_t) (numerator_rpm / (t1_count >> 4));
-
-            if ((rpm > FIXED_IG_RPM)&&(rpm <= MAX_MAP_RPM)) {
-                ig_counter = IG_table[rpm];
-                IGEN = IG_ENABLE;
-                if ((ig_counter - 15) > TMR1) {
-                    CCPR2 = ig_counter;
-                    ccp2_enable();
-                } else {
-                    ccp2_disable();
-                    IGOUT = IG_GATE_ON;
-                    __delay_us(60);
-                    IGOUT = IG_GATE_OFF;
-                }
-            }//Disable ditital map ignition under 1500rpm or over 13000rpm
-            else {
+            if ((ig_next_arm)&&(!pu1_resync)) {
+                if (t1_ps_next != t1_ps) lat = 0; //Delay is in counts of old prescale
+                ig_counter = (ig_next > lat) ? ig_next - lat : 0;
+                IGEN = ig_next_igen;
+                ig_arm(ig_counter, t1_ps_margin[t1_ps_next]);
+            } else if ((!ig_next_arm)&&(ig_next_igen == IG_DISABLE)) {
+                //Cut by rev limit or quick shifter
+                ignition_disable();
+            } else {
+                //No map ignition or resync. PU2 analog ignition
                 ccp2_disable();
                 IGEN = IG_ENABLE;
             }
-
-            //Rev limit controll
-            if (revlimit_state == REVLIMIT_ENABLE) {
-                if ((rpm > REVLIMIT_L)&&(rpm < REVLIMIT_M)) {
-                    orev_counter++;
-                    if (orev_counter == 3) ignition_disable();
-                }
-                if ((rpm >= REVLIMIT_M)&&(rpm < REVLIMIT_H)) {
-                    orev_counter++;
-                    if (orev_counter == 2) ignition_disable();
-                }
-                if (rpm >= REVLIMIT_H) ignition_disable();
-            }
-
-            //Power jet controll
-            if (pwj_state == PWJ_ENABLE) {
-                if (rpm > PWJ_CUT_RPMH) PWJOUT = 1;
-                else if (rpm < PWJ_CUT_RPML) PWJOUT = 0;
-            } else if (pwj_state == PWJ_DISABLE) {
-                if (rpm > PWJ_DISABLE_RPMH) PWJOUT = 1;
-                else if (rpm < PWJ_DISABLE_RPML) PWJOUT = 0;
+            //TMR1 already runs at t1_ps_next
+            t1_ps_old = t1_ps;
+            t1_ps = t1_ps_next;
+            ig_seg = 0;
+            pu2_in = 0; //pu2_t is of last period
+            ig_stage2 = 1;
+        } else {
+            //Start or PU1 healthy again in PU2 limp
+            if (limp_pu2) {
+                ccp2_disable();
+                limp_pu2 = 0;
             }
-        } else if (EG_state == EG_LOW) {
-            TMR1ON = 0;
+            t1_ps = 0;
+            t1_ps_next = 0;
+            T1CON = t1_ps_con[0];
             TMR1H = 0x00;
             TMR1L = 0x00;
             TMR1ON = 1;
-            EG_state = EG_RUN;
+            TMR1IF = 0;
+            t1_ovf = 0;
+            pu1_blank = 0;
+            pu1_long = 0xFFFFFF;
+            IGEN = IG_ENABLE;
+            ig_next_arm = 0;
+            ig_next_igen = IG_ENABLE;
+            ig_stage2 = 0;
+            eg_bad = 0;
+            eg_good = 0;
+            launch_lockout = 0;
+            launch_sw_sample();
+            eg_set_state(EG_SYNCING);
         }
+        //Stage 2 at once if no spark is armed, else after it in CCP2 ISR
+        if (!ig_stage2) publish_snapshot();
+        else if (!CCP2IE) ig_pipeline();
         ccp1_enable();
         //Write_table();
     }
@@ -364,49 +1700,488 @@ void __interrupt() InterruptManager() {
         ccp2_disable();
         IGOUT = 0;
         ccp1_enable();
-        if (rpm < 30) calc_map();
+        if (ig_stage2) ig_pipeline();
         CCP2IF = 0;
     }
 
-    //Prevent reverse rotation  ex)stop at hill climbe
+    //ADC conversion done. TPS or pot (TMR2 trigger)
+    if (ADIF) {
+        adc = ((uint16_t) ADRESH << 8) | ADRESL;
+        if (adc_ch == ADC_POT) {
+            pot = (uint8_t) (adc >> 2);
+            adc_tmr2_ch = ADC_TPS;
+        } else {
+            //Replace oldest TPS sample
+            if ((adc > tps_buf[tps_idx])&&((adc - tps_buf[tps_idx]) >= TRANS_DTPS)&&(EG_state == EG_RUNNING)) trans_rev = TRANS_REV;
+            tps_sum -= tps_buf[tps_idx];
+            tps_buf[tps_idx] = adc;
+            tps_sum += adc;
+            tps_idx = (tps_idx + 1) & (TPS_BUF_SIZE - 1);
+            tps = (uint8_t) (tps_sum >> (TPS_BUF_SHIFT + 2));
+#if POT_ENABLE
+            if (++adc_seq >= POT_EVERY) {
+                adc_seq = 0;
+                adc_tmr2_ch = ADC_POT;
+            }
+#endif
+        }
+        adc_tmr2_sel(); //Next TMR2 trigger is 4.1ms later, enough for acquisition
+        ADIF = 0;
+    }
+
+    //Launch switch edge. Takes effect at next PU1, then edges are locked out
+    if (IOCAF1) {
+        launch_sw_sample();
+        IOCAP1 = 0;
+        IOCAN1 = 0;
+        launch_lockout = LAUNCH_DEBOUNCE_REV;
+        IOCAF1 = 0;
+    }
+
+#if QS_ENABLE
+    //Quick shifter edge. Cancel armed spark now, cut by kill time table
+    if (IOCBF4) {
+        if ((EG_state == EG_RUNNING)&&(qs_lock == 0)&&(rpm >= qs_min_bin)) {
+            a = (uint8_t) ((rpm - QS_MIN_RPM) / QS_STEP);
+            if (a >= QS_SIZE) a = QS_SIZE - 1;
+            ignition_disable();
+            if (ig_stage2) ig_pipeline(); //Spark cancelled. Stage 2 now
+            qs_cut = qs_kill_table[a];
+            qs_lock = qs_lock_table[a];
+            //Next revolution is already computed. Cut it here
+            ig_next_arm = 0;
+            ig_next_igen = IG_DISABLE;
+            qs_cut--;
+        }
+        IOCBF4 = 0;
+    }
+#endif
+
+    //UART receive. Parameter commands are parsed in the main loop
+    if (RC1IF) {
+        if (RC1STAbits.OERR) {
+            RC1STAbits.CREN = 0;
+            RC1STAbits.CREN = 1;
+        }
+        a = RC1REG;
+        if (((rx_head + 1) & (RX_BUF_SIZE - 1)) != rx_tail) {
+            rx_buf[rx_head] = a;
+            rx_head = (rx_head + 1) & (RX_BUF_SIZE - 1);
+        }
+    }
+
+    //PU2 edge. PU2 limp and PU1 loss detection
     if (IOCAF2) {
-        if (EG_state == EG_RUN) {
+        if (limp_pu2) {
+            //PU2 limp. Period from last PU2 edge and spark by CCP2 after PU2
+            T1CON = t1_ps_con[0]; //TMR1 off
+            t1_count = TMR1;
+            TMR1H = 0x00;
+            TMR1L = 0x00;
+            TMR1ON = 1;
+            if (TMR1IF) {
+                if (t1_count < 0x8000) t1_ovf++;
+                TMR1IF = 0;
+            }
+            t1_ovf_cap = t1_ovf;
+            t1_ovf = 0;
+            period = ((uint24_t) t1_ovf_cap << 16) | t1_count;
+            rpm = period_rpm(period, 0);
+            limp_good = (pu1_seen == 1) ? limp_good + 1 : 0;
+            if (limp_good > LIMP_EXIT_REV) limp_good = LIMP_EXIT_REV;
+            pu1_seen = 0;
+            IGEN = IG_DISABLE;
+            if ((rpm >= CRANK_MIN_RPM)&&(rpm <= MAX_MAP_RPM)) {
+                //Bands 0/1 (0deg retard) fire now
+                ig_counter = limp_ret_table[rpm / LIMP_RPM_STEP];
+                ig_arm(ig_counter, t1_ps_margin[0]);
+            } else {
+                ccp2_disable();
+                IGEN = IG_ENABLE;
+            }
+            publish_snapshot();
+        } else if (EG_state != EG_STOPPED) {
+            //PU1 lost: restart TMR1 at this PU2. PU2 analog ignition until a period is known
+            //Spark of this period still pending: PU1 was seen, pu1_long may be of old prescale
+            period = ((uint24_t) t1_ovf << 16) | TMR1;
+            if ((!ig_stage2)&&(period > pu1_long)) {
+                T1CON = t1_ps_con[0];
+                TMR1H = 0x00;
+                TMR1L = 0x00;
+                TMR1ON = 1;
+                TMR1IF = 0;
+                t1_ps = 0;
+                t1_ps_next = 0;
+                t1_ovf = 0;
+                pu1_blank = 0;
+                pu1_long = 0xFFFFFF;
+                ccp2_disable();
+                IGEN = IG_ENABLE;
+                ig_next_arm = 0;
+                limp_pu2 = 1;
+                pu1_seen = 0;
+                limp_good = 0;
+                eg_set_state(EG_LIMP);
+            } else if ((EG_state == EG_RUNNING)&&(t1_ovf == 0)&&(pu2_in)&&(t1_ps == t1_ps_old)) {
+                //PU1-PU2 segment speed for next PU1
+                pu2_t += t1_lat - (PU2_STAMP_LAT >> (T1_PS_FINE_SHIFT - t1_ps_shift[t1_ps]));
+                ig_seg = (uint24_t) pu2_t * pu12_seg_mul;
+                if (pu12_seg_frac != 0) ig_seg += fx_mulh16x16(pu2_t, pu12_seg_frac);
+                if (!ig_stage2) ig_next_seg();
+            }
+        }
+        //Prevent reverse rotation  ex)stop at hill climbe
+        if (EG_state != EG_STOPPED) {
             /*
             pu1_2_period_count = TMR1;
-            if ((rpm < 25)&&((t1_count - pu1_2_period_count)<(pu1_2_period_count << 2))) {
+            if ((rpm < RPM2BIN(2500))&&((t1_count - pu1_2_period_count)<(pu1_2_period_count << 2))) {
                 IGEN = IG_DISABLE;
             }
              */
             //ccp1_enable();
-            //if (rpm < 20) calc_map();
+            //if (rpm < RPM2BIN(2000)) calc_map();
         }
         IOCAF2 = 0;
     }
-    //If low rpm or stop
+    //Count period overflow. If low rpm or stop
     if (TMR1IF) {
-        EG_state = EG_LOW;
-        TMR1ON = 0;
-        TMR1H = 0x00;
-        TMR1L = 0x00;
-        CCPR1 = 0;
-        CCPR2 = 0;
         TMR1IF = 0;
-        PWJOUT = 0;
-        ccp2_disable();
-        IGOUT = 0;
+        if (t1_ovf < (t1_ps_stop_ovf[t1_ps] - 1)) {
+            t1_ovf++;
+        } else {
+            eg_set_state(EG_STOPPED);
+            TMR1ON = 0;
+            TMR1H = 0x00;
+            TMR1L = 0x00;
+            CCPR1 = 0;
+            CCPR2 = 0;
+            t1_ovf = 0;
+            ccp2_disable();
+            IGOUT = 0;
+            IGEN = IG_ENABLE;
+            launch_lockout = 0;
+            launch_sw_sample();
+            qs_cut = 0;
+            qs_lock = 0;
+            trans_rev = 0;
+            limp_pu2 = 0;
+            ig_next_arm = 0;
+            ig_stage2 = 0;
+            publish_snapshot();
+        }
     }
     CLRWDT();
 }
 
+//-------------------------------
+// Ignition pipeline stage 2 sub (ISR only)
+// Period of last PU1 -> rpm, engine state and the spark of next PU1
+//-------------------------------
+
+void ig_pipeline(void) {
+    uint8_t a, rl;
+    uint8_t ig_cut;         //1:No spark in next revolution (rev limit or quick shift)
+    uint8_t sync;
+    uint16_t revlimit_ret;
+    int16_t trans_ret;
+    uint24_t period;
+
+    ig_stage2 = 0;
+    sync = (EG_state == EG_SYNCING);
+    period = ((uint24_t) t1_ovf_cap << 16) | t1_count;
+    if (pu1_resync) pu1_resync_cnt++;
+
+    rpm = period_rpm(period, t1_ps_old);
+
+    //Engine state
+    if (pu1_resync) {
+        eg_good = 0;
+        if (eg_bad < LIMP_ENTER_REV) eg_bad++;
+        if (eg_bad >= LIMP_ENTER_REV) eg_set_state(EG_LIMP);
+    } else {
+        eg_bad = 0;
+        if ((EG_state == EG_LIMP)&&(++eg_good < LIMP_EXIT_REV)) {
+            //Stay in limp
+        } else if (EG_state == EG_RUNNING) {
+            if (rpm < RUN_EXIT_RPM) eg_set_state(EG_CRANKING);
+        } else if (rpm >= RUN_ENTER_RPM) {
+            eg_set_state(EG_RUNNING);
+        } else {
+            eg_set_state(EG_CRANKING);
+        }
+    }
+    if (rpm >= t1_ps_up_rpm[t1_ps]) t1_ps_next = t1_ps + 1;
+    else if (rpm < t1_ps_down_rpm[t1_ps]) t1_ps_next = t1_ps - 1;
+
+#if PU1_FILTER_ENABLE
+    //Next blanking window and plausibility limit in counts of running prescale
+    if (((EG_state != EG_RUNNING)&&(EG_state != EG_LIMP)) || (pu1_resync)) {
+        pu1_blank = 0;
+        pu1_long = 0xFFFFFF;
+    } else {
+        if (t1_ps > t1_ps_old) period <<= (t1_ps_shift[t1_ps] - t1_ps_shift[t1_ps_old]);
+        else period >>= (t1_ps_shift[t1_ps_old] - t1_ps_shift[t1_ps]);
+        pu1_blank = (uint16_t) (period >> PU1_BLANK_SHIFT);
+        pu1_long = period + (period >> PU1_LONG_SHIFT);
+    }
+#endif
+
+    //Launch switch debounce
+    if (launch_lockout != 0) {
+        launch_lockout--;
+        if (launch_lockout == 0) launch_sw_sample();
+    }
+
+    //Rev limit controll. Launch limitter overrides the main one while held
+    ig_cut = 0;
+    revlimit_ret = 0;
+    rl = (launch_state == LAUNCH_ENABLE) ? REVLIMIT_LAUNCH : REVLIMIT_MAIN;
+    if (((revlimit_state == REVLIMIT_ENABLE) || (rl == REVLIMIT_LAUNCH))&&(rpm >= revlimit_l_bin[rl])) {
+        if (rpm >= revlimit_h_bin[rl]) {
+            ig_cut = 1;
+        } else {
+            a = (uint8_t) ((rpm - revlimit_l_bin[rl]) / REVLIMIT_STEP);
+            revlimit_ret = revlimit_ret_table[rl][a];
+            revlimit_acc += revlimit_cut_table[rl][a];
+            if (revlimit_acc >= REVLIMIT_CUT_FULL) {
+                revlimit_acc -= REVLIMIT_CUT_FULL;
+                ig_cut = 1;
+            }
+        }
+    } else {
+        revlimit_acc = 0;
+    }
+
+    //Quick shifter
+    if (qs_lock != 0) qs_lock--;
+    if (qs_cut != 0) {
+        qs_cut--;
+        ig_cut = 1;
+    }
+
+    //Throttle transient correction decays per revolution
+    trans_ret = 0;
+    if (trans_rev != 0) {
+        trans_ret = trans_table[trans_rev - 1][rpm / TRANS_RPM_STEP];
+        trans_rev--;
+    }
+
+    //Spark of next PU1 in counts of t1_ps_next
+    ig_next_arm = 0;
+    ig_next_map = 0;
+    ig_next_igen = IG_ENABLE;
+    if (ig_cut) {
+        ig_next_igen = IG_DISABLE;
+    } else if ((ig_map_ready)&&(rpm >= CRANK_MIN_RPM)&&(rpm <= MAX_MAP_RPM)&&(!pu1_resync)&&(EG_state != EG_LIMP)) {
+        ig_next_arm = 1;
+        //Cranking map fires digitally only
+        if (rpm < FIXED_IG_RPM) {
+            ig_next = ig_map_wait(rpm);
+            ig_next_igen = IG_DISABLE;
+        } else {
+            ig_next_add = (int16_t) revlimit_ret + trans_ret;
+            ig_next = fx_adds16(ig_map_wait(rpm), ig_next_add) >> (T1_PS_FINE_SHIFT - t1_ps_shift[t1_ps_next]);
+            ig_next_map = 1;
+            ig_tbin = t1_ps_rpm_num[t1_ps] / rpm;
+            ig_next_seg();
+        }
+    }//Disable ditital map ignition under 200rpm or over 16000rpm or at resync or limp or at boot
+
+    //EG_SYNCING: nothing was armed at this PU1. First period sparks late
+    if ((sync)&&(ig_next_arm)&&(t1_ps_next == t1_ps)) {
+        ig_counter = ig_next;
+        IGEN = ig_next_igen;
+        ig_arm(ig_counter, t1_ps_margin[t1_ps]);
+    }
+    publish_snapshot();
+}
+
+//-------------------------------
+// Map bin to waiting time sub (ISR only)
+// Angle of bin a from PU1 as waiting time, less the latency. Cranking bins
+// (under FIXED_IG_RPM) in 1us, map bins in 0.125us. Once per revolution
+// from flash tables and the map buffer of ig_map_sel.
+//-------------------------------
+
+uint16_t ig_map_wait(uint16_t a) {
+    uint16_t deg, temp, lat;
+#if IG_MAP_2D
+    const int16_t *c;
+    uint8_t i, f;
+    int16_t d;
+#else
+    const IG_CURVE *c;
+    int16_t sl;
+    uint8_t n;
+#endif
+
+    if (a < FIXED_IG_RPM) {
+        //(coeff x deg / 2) >> 10 as high word of (coeff << 1) x (deg / 2 << 5). coeff < 32768 from CRANK_MIN_RPM
+        temp = fx_mulh16x16(deg2time_coeff[a] << 1, ((param_pu1_deg - crank_deg_table[(a * RPM_BIN_WIDTH) / 100]) >> 1) << 5); //1us
+        return (temp > LAT_US(a)) ? temp - LAT_US(a) : 0;
+    }
+#if IG_MAP_2D
+    c = ig_col[ig_map_sel];
+    for (i = 0; (i < IG_RPM_SIZE - 2)&&(a > ig_rpm_axis[i + 1]); i++);
+    if (a == ig_rpm_axis[i + 1]) {
+        deg = (uint16_t) c[i + 1];
+    } else {
+        //Position in segment in 1/256 (segment < 256 bins)
+        f = (uint8_t) fx_mulh16x8(ig_rpm_rcp[i], (uint8_t) (a - ig_rpm_axis[i]));
+        d = c[i + 1] - c[i];
+        if (d >= 0) deg = (uint16_t) c[i] + fx_mulh16x8((uint16_t) d, f);
+        else deg = (uint16_t) c[i] - fx_mulh16x8((uint16_t) -d, f);
+    }
+#else
+    //A later segment overrides an earlier one where they overlap (p2x over p3x)
+    c = &ig_curve[ig_map_sel];
+    sl = 0;
+    n = 0;
+    if (a > c->p4x) {
+        deg = c->p4y;
+    } else if (a > c->p3x) {
+        deg = c->p3y;
+        sl = c->slope2;
+        n = (uint8_t) (a - c->p3x);
+    } else if (a > c->p2x) {
+        deg = c->p3y;
+    } else if (a > c->p1x) {
+        deg = c->p1y;
+        sl = c->slope1;
+        n = (uint8_t) (a - c->p1x);
+    } else {
+        deg = c->p1y;
+    }
+    //Slope x bins / 256, truncated toward 0
+    if (sl >= 0) deg += fx_mulh16x8((uint16_t) sl, n);
+    else deg -= fx_mulh16x8((uint16_t) -sl, n);
+#endif
+    //(coeff x deg / 2) >> 7 as high word of (coeff << 4) x (deg / 2 << 5). coeff < 4096 from FIXED_IG_RPM
+    temp = fx_mulh16x16(deg2time_coeff[a] << 4, ((param_pu1_deg - deg) >> 1) << (T1_PS_FINE_SHIFT + 2)); //0.125us
+    lat = (uint16_t) LAT_US(a) << T1_PS_FINE_SHIFT;
+    return (temp > lat) ? temp - lat : 0;
+}
+
+//-------------------------------
+// Period to rpm sub (ISR only)
+// period in counts of prescale stage ps, up to 24bit with overflows
+// At or over t1_ps_min_period the quotient is at most MAX_MAP_RPM, so
+// RPM_Q_BITS of restoring division are exact (floor).
+//-------------------------------
+#define RPM_Q_BITS          (9)
+#if (MAX_MAP_RPM >> RPM_Q_BITS)
+#error "MAX_MAP_RPM over RPM_Q_BITS"
+#endif
+
+uint16_t period_rpm(uint24_t period, uint8_t ps) {
+    uint24_t n;
+    uint32_t d;
+    uint16_t q;
+    uint8_t i;
+
+    if (period < t1_ps_min_period[ps]) return MAX_MAP_RPM + 1;
+    n = t1_ps_rpm_num[ps];
+    d = (uint32_t) period << (RPM_Q_BITS - 1);
+    q = 0;
+    for (i = 0; i < RPM_Q_BITS; i++) {
+        q <<= 1;
+        if (n >= d) {
+            n -= (uint24_t) d;
+            q |= 0x01;
+        }
+        d >>= 1;
+    }
+    return q;
+}
+
+//-------------------------------
+// Segment speed to next spark sub (ISR only)
+// Waiting time of ig_next (map angle at rpm) at the speed of ig_seg:
+// (ig_next + lat) x ig_seg / ig_tbin - lat, as a difference to ig_next
+// diff / ig_tbin is at most 1/2^SEG_MAX_SHIFT, a fx_divf16() fraction.
+//-------------------------------
+
+void ig_next_seg(void) {
+    uint16_t lat, d;
+    uint24_t diff;
+
+    if ((!ig_next_map) || (ig_seg == 0)) return;
+    diff = (ig_seg > ig_tbin) ? ig_seg - ig_tbin : ig_tbin - ig_seg;
+    if (diff > (ig_tbin >> SEG_MAX_SHIFT)) return;
+    lat = (uint16_t) LAT_US(rpm) << t1_ps_shift[t1_ps_next];
+    d = fx_mulh16x16(ig_next + lat, fx_divf16(diff, ig_tbin));
+    if (ig_seg > ig_tbin) ig_next += d;
+    else ig_next = (ig_next > d) ? ig_next - d : 0;
+}
+
+//-------------------------------
+// Launch switch sample sub (ISR only)
+// Read LAUNCH_SW level and enable its IOC on both edges
+//-------------------------------
+
+void launch_sw_sample(void) {
+    if (LAUNCH_SW == LAUNCH_ACTIVE) launch_state = LAUNCH_ENABLE;
+    else launch_state = LAUNCH_DISABLE;
+    IOCAP1 = 1;
+    IOCAN1 = 1;
+}
+
+//-------------------------------
+// Engine state change sub (ISR only)
+//-------------------------------
+
+void eg_set_state(uint8_t state) {
+    if (EG_state != state) {
+        EG_state = state;
+        eg_trans_cnt++;
+    }
+}
+
+//-------------------------------
+// ADC channel select for TMR2 trigger sub (ISR only)
+//-------------------------------
+
+void adc_tmr2_sel(void) {
+    adc_ch = adc_tmr2_ch;
+    ADACT = ADACT_TMR2;
+    ADCON0 = (adc_ch == ADC_POT) ? POT_ADCON0 : TPS_ADCON0;
+}
+
 //-------------------------------
 // Disaable ignition sub
+// Armed spark and PU2 analog ignition off. CCP1 is not touched, as
+// ccp1_enable() would clear a PU1 capture pending in the ISR.
 //-------------------------------
 
 void ignition_disable(void) {
     ccp2_disable();
     IGEN = IG_DISABLE;
-    orev_counter = 0;
-    ccp1_enable();
+}
+
+//-------------------------------
+// Spark arm sub (ISR only)
+// CCP2 compare at count if it leads TMR1 by more than margin counts, else
+// the spark is fired now. Signed check: a count at or behind TMR1 (0 of
+// limp bands 0/1, late stage 2) would wrap in an unsigned difference (XC8
+// int is 16bit, so uint16_t - uint8_t stays unsigned) and arm a compare
+// that matches only after a TMR1 overflow.
+// Returns 1 when CCP2 is armed.
+//-------------------------------
+
+uint8_t ig_arm(uint16_t count, uint8_t margin) {
+    uint16_t t;
+
+    t = TMR1;
+    if ((count > t)&&((uint16_t) (count - t) > margin)) {
+        CCPR2 = count;
+        ccp2_enable();
+        return 1;
+    }
+    ccp2_disable();
+    IGOUT = IG_GATE_ON;
+    __delay_us(60);
+    IGOUT = IG_GATE_OFF;
+    return 0;
 }
 
 //-------------------------------
@@ -452,15 +2227,23 @@ void ccp2_disable(void) {
 }
 
 //-------------------------------
-// system initialize
+// Ignition initialize (boot, first)
+// Pins, TMR1, CCP1 capture, CCP2 compare and PPS. PU1 capture is armed at
+// the end, interrupts on. The first PU1 edge restarts TMR1 (EG_SYNCING)
+// and PU2 analog ignition is enabled, so a kick during the rest of the
+// boot is not lost. PPS1WAY allows one lock, so all PPS is set here.
 //-------------------------------
 
-void initialize_system(void) {
+void initialize_ignition(void) {
     //clock setting
     OSCEN = 0x40; //HFINTOSC ENABLE
     OSCFRQ = 0x05; //32MHz
     OSCTUNE = 0X00;
 
+    //Timer0 for boot_ticks. initialize_system() sets the main loop time base
+    T0CON1 = 0b01001000; //Fosc/4, 1:256 Prescaler = 32us
+    T0CON0 = 0b10010000; //TMR0 enable, 16bit
+
     //PORT rest
     PORTA = 0x00;
     PORTB = 0x00;
@@ -468,25 +2251,37 @@ void initialize_system(void) {
     LATA = 0x00;
     LATB = 0x00;
     LATC = 0x00;
-    ANSELA = 0x00;
+    IGOUT = IG_GATE_OFF;
+    IGEN = IG_ENABLE;
+    ANSELA = 0b00100000; //RA5 is analog (TPS)
     ANSELB = 0x00;
+#if POT_ENABLE
+    ANSELC = 0b01000000; //RC6 is analog (blend pot)
+#else
     ANSELC = 0x00;
+#endif
 
     //PORT setting
-    TRISA = 0b00110100; //IN:RA2/4/5 
+    TRISA = 0b00110110; //IN:RA1/2/4/5 
     TRISB = 0b10110000; //IN:RB4-5,7
+#if YPVS_ENABLE
+    TRISC = 0b11110001; //IN:RC0/4-7 OUT:RC1-3
+#else
     TRISC = 0b11111001; //IN:RC0/3-7 OUT:RC1/2
-    INLVLA = 0b00110100; //RA2/4/5 is Schmitt triger
+#endif
+    INLVLA = 0b00110110; //RA1/2/4/5 is Schmitt triger
+    WPUA = 0b00000010; //RA1 weak pull up for launch switch
     INLVLB = 0b10110000; //RB4-5,7 is Schmitt triger
-    INLVLC = 0b11111001; //RC0/3-7 is Schmitt triger
+#if QS_ENABLE
+    WPUB = 0b00010000; //RB4 weak pull up for quick shifter
+#endif
+    INLVLC = 0b11110001; //RC0/4-7 is Schmitt triger
 
     //Timer1 setting for PU1 detection and Ignition
     T1CLK = 0b00000001; //Clock source is Fosc/4 = 500ns
-    T1CON = 0b00110000; //1:8 Prescaler
+    T1CON = 0b00110010; //1:8 Prescaler, 16bit read (TMR1H latched at TMR1L read)
     TMR1 = 0x0000;
 
-    //AD setting for throttle position sensor
-
     //CCP setting
     CCP1CAP = 0x0; //CCP1 Pin is RC0 (Selected by CCP1PPS)
     CCP2CAP = 0x0; //CCP2 Pin is RC1 (Selected by CCP2PPS)
@@ -505,10 +2300,67 @@ void initialize_system(void) {
     RC1PPS = 0x02; //Output compare pin2 = RC1
     RX1PPS = 0x0F; //RX1 = RB7
     RB6PPS = 0x05; //TX1 = RB6
+    RA0PPS = 0x03; //PWM3 = RA0 (power jet)
+#if YPVS_ENABLE
+    RC3PPS = 0x04; //PWM4 = RC3 (power valve servo)
+#endif
     PPSLOCK = 0x55; //lock PPS
     PPSLOCK = 0xAA;
     PPSLOCKbits.PPSLOCKED = 1;
 
+    //Clear all interrupt flag
+    PIR0 = 0x0;
+    PIR1 = 0x0;
+    PIR2 = 0x0;
+
+    //interrupt inable
+    GIE = 1;
+    PEIE = 1;
+    CCP1IE = 1;
+    CCP2IE = 1;
+    TMR1IE = 1;
+    IOCIE = 1;
+    ccp2_disable();
+    ccp1_enable();
+}
+
+//-------------------------------
+// system initialize (boot, after the maps)
+// Main loop peripherals. PU1 may already be running the ISR.
+//-------------------------------
+
+void initialize_system(void) {
+    //Timer0 setting for main loop time base. Free running, no interrupt
+    T0CON1 = 0b01001101; //Fosc/4, 1:8192 Prescaler = 1.024ms
+    T0CON0 = 0b10010000; //TMR0 enable, 16bit
+
+    //Timer2 and PWM3 setting for power jet solenoid (RA0)
+    T2CLKCON = 0x01; //Clock source is Fosc/4
+    T2PR = 0xFF; //Period 256 x 16us = 4.1ms (244Hz)
+    T2CON = 0b11110000; //TMR2 on, 1:128 Prescaler, 1:1 Postscaler
+    PWM3DCH = 0x00;
+    PWM3DCL = 0x00;
+    PWM3CON = 0x80; //PWM3 enable, active high
+#if YPVS_ENABLE
+    //PWM4 setting for power valve servo (RC3). Starts at closed position
+    PWM4DCH = (uint8_t) (YPVS_PULSE_MIN >> 2);
+    PWM4DCL = (uint8_t) (YPVS_PULSE_MIN << 6);
+    PWM4CON = 0x80; //PWM4 enable, active high
+#endif
+
+    //AD setting for throttle position sensor
+    ADCON1 = 0b10100000; //Right justified, Fosc/32 (1us), VDD reference
+    adc_tmr2_sel(); //Conversion is started by TMR2 period match
+    ADIF = 0;
+    ADIE = 1;
+
+    //IOC setting
+    IOCAP1 = 1; //RA1 both edge detection (launch switch)
+    IOCAN1 = 1;
+#if QS_ENABLE
+    IOCBN4 = 1; //RB4 negative edge detection (quick shifter)
+#endif
+
     //UART setting
     BAUD1CON = 0x00;
     RC1STA = 0x00;
@@ -517,29 +2369,16 @@ void initialize_system(void) {
     SP1BRGH = 0x00;
     //ABDEN disabled; WUE disabled; BRG16 8bit_generator; SCKP Non-Inverted; 
     BAUD1CON = 0x40;
-    //ADDEN disabled; CREN disabled; SREN disabled; RX9 8-bit; SPEN enabled; 
-    RC1STA = 0x80;
+    //ADDEN disabled; CREN enabled; SREN disabled; RX9 8-bit; SPEN enabled; 
+    RC1STA = 0x90;
     //TX9D 0x0; BRGH Hi_speed; SENDB sync_break_complete; SYNC asynchronous; TXEN enabled; TX9 8-bit; CSRC client; 
     TX1STA = 0x26;
     //baud late 57.6k 
     SP1BRGL = 0x22;
     //SPBRGH 0; 
     SP1BRGH = 0x0;
+    RC1IE = 1; //Parameter commands
 
     //Watch dog timer setting
     WDTCON = 0x0F; //128ms interval
-
-    //Clear all interrupt flag
-    PIR0 = 0x0;
-    PIR1 = 0x0;
-    PIR2 = 0x0;
-
-    //interrupt inable
-    GIE = 1;
-    PEIE = 1;
-    CCP1IE = 1;
-    CCP2IE = 1;
-    TMR1IE = 1;
-    IOCIE = 1;
-    IGOUT = 0;
 }
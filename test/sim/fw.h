@@ -0,0 +1,151 @@
+/*--------------------------------------------------------------------------
+ Firmware under test
+ main.c is compiled into the test itself, so tests see its tables, state
+ and #defines. Flash tables lose const so cal_write_row() can rewrite them
+ through the simulated NVM, and main() is renamed as it never returns.
+ Helpers are static inline, a test that does not use one builds clean.
+------------------------------------------------------------------------- */
+
+#ifndef FW_H
+#define FW_H
+
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim.h"
+
+static void fw_boot_map(void);
+
+#define const
+#define main cdi_main
+#define BOOT_MAP_HOOK() fw_boot_map()
+#include "main.c"
+#undef main
+#undef const
+
+#define FAIL(...) do { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); exit(1); } while (0)
+#define CHECK(c, ...) do { if (!(c)) FAIL(__VA_ARGS__); } while (0)
+
+//-------------------------------
+// Cycle model (instruction cycles, 125ns)
+// The simulator runs the firmware in zero time. Main loop, boot and the
+// stage 2 map read are priced by the kernel cycles of the Fixed point
+// kernels block and XC8 library estimates.
+//-------------------------------
+
+#define CY_US               (8.0)
+#define CY_MULH16X8         (120)
+#define CY_MULH16X16        (240)
+#define CY_RECIP16          (650)
+#define CY_DIVF16           (350)
+#define CY_PERIOD_RPM       (320)   //period_rpm(), 9 quotient bits
+#define CY_LWDIV            (350)   //__lwdiv, LAT_US() index
+#define CY_MUL24            (400)   //__mul24
+#define CY_DIV24            (800)   //__aldiv, 24bit signed
+#define CY_MUL32            (800)   //__lmul
+#define CY_DIV32            (1000)  //__aldiv, 32bit
+#define CY_BIN              (150)   //Call, table reads, shifts, compares
+#define CY_SEG              (12)    //ig_rpm_axis compare per segment passed
+#define CY_MAP_BIN          (2 * CY_MULH16X8 + CY_MULH16X16 + CY_LWDIV + CY_BIN) //ig_map_wait() of a map bin
+#define CY_MAP_WAIT         (CY_MAP_BIN + (IG_RPM_SIZE - 2) * CY_SEG) //ig_map_wait(), worst
+#define CY_NEXT_SEG         (CY_LWDIV + CY_DIVF16 + CY_MULH16X16 + CY_BIN) //ig_next_seg()
+#define CY_COL              (IG_RPM_SIZE * (3 * (CY_MUL24 + CY_DIV24) + 100)) //ig_map_col()
+
+#define CY_CALC_MAP         (CY_COL + (IG_RPM_SIZE - 1) * (uint32_t) CY_RECIP16)
+
+//-------------------------------
+// Boot as main() does, switches in their pulled up (open) state
+// With fw_boot_engine set the engine turns from time 0 and calc_map() takes
+// its cycle model time in BOOT_MAP_HOOK(), spent before the map is written
+// (worst case: the ISR sees it unbuilt all along).
+//-------------------------------
+
+static SIM_RPM_FN fw_boot_engine;
+
+static void fw_boot_map(void) {
+    if (fw_boot_engine) sim_run(sim_now() + CY_CALC_MAP / CY_US);
+}
+
+static inline void fw_boot(void) {
+    sim_init();
+    sim_flash_map(PARAM_ADDR, (void *) &param_flash, sizeof (param_flash));
+    sim_flash_map(IG_MAP_ADDR, (void *) ig_map_2d, sizeof (ig_map_2d));
+    sim_pin('A', 1, 1);
+    sim_pin('A', 4, 1);
+    sim_pin('B', 4, 1);
+    sim_pin('B', 5, 1);
+    sim_pin('C', 3, 1);
+    sim_pin('C', 4, 1);
+    sim_pin('C', 5, 1);
+    sim_pin('C', 6, 1);
+    sim_pin('C', 7, 1);
+    if (fw_boot_engine) sim_engine(fw_boot_engine, param_flash.pu1_deg / 100.0);
+    boot();
+}
+
+//-------------------------------
+// Run one scenario in a child process
+// Firmware globals cannot be re-initialized, so every boot gets a fresh
+// copy of them. A failed CHECK in the child fails the parent.
+//-------------------------------
+
+static inline void fw_fork(void (*fn)(void *), void *arg) {
+    pid_t pid;
+    int st;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        fn(arg);
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid, &st, 0);
+    if ((!WIFEXITED(st)) || (WEXITSTATUS(st) != 0)) exit(1);
+}
+
+//-------------------------------
+// Main loop pass without telemetry
+//-------------------------------
+
+static inline void fw_loop(void) {
+    (void) main_pass();
+}
+
+//-------------------------------
+// Map angle of bin b in deg, exact interpolation of the map ig_map_wait()
+// reads (ig_col[] or the switch curve)
+//-------------------------------
+
+static inline double fw_map_deg(uint16_t b) {
+#if IG_MAP_2D
+    const int16_t *c = ig_col[ig_map_sel];
+    uint8_t i;
+
+    for (i = 0; (i < IG_RPM_SIZE - 2)&&(b > ig_rpm_axis[i + 1]); i++);
+    return (c[i] + (double) (c[i + 1] - c[i]) * (b - ig_rpm_axis[i])
+            / (ig_rpm_axis[i + 1] - ig_rpm_axis[i])) / 100.0;
+#else
+    const IG_CURVE *c = &ig_curve[ig_map_sel];
+
+    if (b > c->p4x) return c->p4y / 100.0;
+    if (b > c->p3x) return (c->p3y + (double) (c->p4y - c->p3y) * (b - c->p3x) / (c->p4x - c->p3x)) / 100.0;
+    if (b > c->p2x) return c->p3y / 100.0;
+    if (b > c->p1x) return (c->p1y + (double) (c->p3y - c->p1y) * (b - c->p1x) / (c->p2x - c->p1x)) / 100.0;
+    return c->p1y / 100.0;
+#endif
+}
+
+//-------------------------------
+// Constant rpm engine
+//-------------------------------
+
+static double fw_const_rpm;
+
+static inline double fw_rpm_const(double t_us, double deg) {
+    (void) t_us;
+    (void) deg;
+    return fw_const_rpm;
+}
+
+#endif
@@ -0,0 +1,8 @@
+/*--------------------------------------------------------------------------
+ main.c alone for the RAM size check of test_ram
+ Unlike fw.h, flash tables stay const, so only RAM is in the data sections.
+------------------------------------------------------------------------- */
+
+#include "sim.h"
+#define main cdi_main
+#include "main.c"
@@ -0,0 +1,535 @@
+/*--------------------------------------------------------------------------
+ PIC16F15245 / engine simulator for host tests
+------------------------------------------------------------------------- */
+
+#include <math.h>
+#include "sim.h"
+
+void InterruptManager(void);
+
+//-------------------------------
+// Registers
+//-------------------------------
+volatile uint8_t T1CON, T1CLK, TMR1IF, TMR1IE;
+volatile uint8_t T0CON0, T0CON1, TMR0H, TMR0IF;
+volatile uint8_t T2CON, T2CLKCON, T2PR;
+volatile uint16_t CCPR1, CCPR2;
+volatile uint8_t CCP1CON, CCP2CON, CCP1CAP, CCP2CAP;
+volatile uint8_t CCP1IF, CCP2IF, CCP1IE, CCP2IE;
+volatile uint8_t PWM3CON, PWM3DCH, PWM3DCL, PWM4CON, PWM4DCH, PWM4DCL;
+volatile PORTAbits_t PORTAbits;
+volatile PORTBbits_t PORTBbits;
+volatile PORTCbits_t PORTCbits;
+volatile uint8_t RA0, RA1, RA2, RA4, RA5, RB4, RB6, RB7, RC0, RC3, RC4, RC5, RC6;
+volatile uint8_t PORTA, PORTB, PORTC, LATA, LATB, LATC, LATA0, LATC2, LATC3;
+volatile uint8_t TRISA, TRISB, TRISC, ANSELA, ANSELB, ANSELC;
+volatile uint8_t INLVLA, INLVLB, INLVLC, WPUA, WPUB, WPUC;
+volatile uint8_t IOCIE, IOCAF1, IOCAP1, IOCAN1, IOCAF2, IOCAN2, IOCBF4, IOCBN4;
+volatile uint8_t GIE, PEIE, PIR0, PIR1, PIR2;
+volatile PPSLOCKbits_t PPSLOCKbits;
+volatile uint8_t PPSLOCK, CCP1PPS, CCP2PPS, RC1PPS, RX1PPS, RB6PPS, RA0PPS, RC3PPS;
+volatile uint8_t OSCEN, OSCFRQ, OSCTUNE, WDTCON, STKPTR;
+volatile ADCON0_t sim_adcon0;
+volatile uint8_t ADCON1, ADACT, ADRESH, ADRESL, ADIF, ADIE;
+volatile RC1STA_t sim_rc1sta;
+volatile int16_t TX1REG = -1;
+volatile uint8_t RC1REG, RC1IF, RC1IE, TX1STA, BAUD1CON, SP1BRGL, SP1BRGH;
+volatile NVMCON1_t sim_nvmcon1;
+volatile uint16_t NVMADR, NVMDAT;
+volatile uint8_t NVMCON2;
+
+//-------------------------------
+// Simulator state
+//-------------------------------
+SIM_EVENT sim_spark[SIM_SPARK_MAX];
+int sim_spark_n;
+SIM_EVENT sim_pu[SIM_SPARK_MAX];
+int sim_pu_n;
+uint16_t sim_adc[64];
+char sim_tx[4096];
+int sim_tx_n;
+int sim_isr_n;
+int sim_reset_n;
+
+static uint64_t now;                //cycles
+static uint8_t in_isr;
+static uint16_t t1;                 //TMR1
+static uint8_t t1_on;
+static uint32_t t1_pre;             //Prescaler count
+static volatile uint16_t t1_shadow; //Accessor copies. A difference is a firmware write
+static volatile uint8_t t1on_shadow;
+static uint8_t t1con_seen;
+static volatile uint8_t latc1_shadow;
+static uint8_t latc1;
+static volatile uint8_t tmr0l_shadow;
+static uint64_t adc_next;           //Next TMR2 period (cycles)
+
+#define QUEUE_SIZE          (256)
+static struct {
+    uint64_t t;
+    uint8_t kind;
+} queue[QUEUE_SIZE];
+static int queue_n;
+
+static SIM_RPM_FN eng_fn;
+static double eng_pu1;              //PU1 deg BTDC
+static double *eng_deg;             //Crank angle at every us
+static double *eng_rpm;
+static size_t eng_n, eng_size;
+
+static struct {
+    uint8_t kind;
+    uint64_t t0, t1;
+} mask;
+
+static char rx_q[256];
+static int rx_q_head, rx_q_tail;
+
+#define FLASH_MAPS          (4)
+static struct {
+    uint16_t addr;
+    uint8_t *obj;
+    uint16_t n;
+} flash_map[FLASH_MAPS];
+static int flash_map_n;
+static uint16_t nvm_latch[32];
+
+static void advance_to(uint64_t t, uint8_t isr);
+
+//-------------------------------
+// Firmware writes through accessors are taken here
+//-------------------------------
+
+static void sim_sync(void) {
+    uint8_t on;
+
+    if (t1_shadow != t1) {
+        t1 = t1_shadow;
+        t1_pre = 0;
+    }
+    on = t1_on;
+    if (T1CON != t1con_seen) on = T1CON & 0x01;
+    if (t1on_shadow != t1_on) on = t1on_shadow & 0x01;
+    t1_on = on;
+    T1CON = (T1CON & 0xFE) | on;
+    t1con_seen = T1CON;
+    t1on_shadow = on;
+    t1_shadow = t1;
+    if ((latc1_shadow & 0x01) != latc1) {
+        latc1 = latc1_shadow & 0x01;
+        if ((latc1)&&(sim_spark_n < SIM_SPARK_MAX)) {
+            sim_spark[sim_spark_n].t = (double) now / SIM_TICK_US;
+            sim_spark[sim_spark_n++].kind = SIM_SPARK_SOFT;
+        }
+    }
+    latc1_shadow = latc1;
+}
+
+volatile uint16_t *sim_tmr1(void) {
+    sim_sync();
+    return &t1_shadow;
+}
+
+volatile uint8_t *sim_tmr1h(void) {
+    sim_sync();
+    return (volatile uint8_t *) &t1_shadow + 1;
+}
+
+volatile uint8_t *sim_tmr1l(void) {
+    sim_sync();
+    return (volatile uint8_t *) &t1_shadow;
+}
+
+volatile uint8_t *sim_tmr1on(void) {
+    sim_sync();
+    return &t1on_shadow;
+}
+
+volatile uint8_t *sim_latc1(void) {
+    sim_sync();
+    return &latc1_shadow;
+}
+
+//TMR0 free running from time 0, Fosc/4 with 2^T0CKPS prescale
+volatile uint8_t *sim_tmr0l(void) {
+    uint16_t v;
+
+    sim_sync();
+    v = (uint16_t) (now >> (T0CON1 & 0x0F));
+    TMR0H = v >> 8;
+    tmr0l_shadow = v & 0xFF;
+    return &tmr0l_shadow;
+}
+
+uint8_t sim_trmt(void) {
+    sim_sync();
+    if (TX1REG >= 0) {
+        if (sim_tx_n < (int) sizeof (sim_tx) - 1) sim_tx[sim_tx_n++] = (char) TX1REG;
+        sim_tx[sim_tx_n] = 0;
+        TX1REG = -1;
+    }
+    return 1;
+}
+
+void sim_reset(void) {
+    sim_reset_n++;
+}
+
+void sim_delay_us(uint32_t us) {
+    sim_sync();
+    advance_to(now + (uint64_t) us * SIM_TICK_US, 0);
+}
+
+//-------------------------------
+// NVM. Second NOP after the unlock runs the operation
+//-------------------------------
+
+static void flash_store(uint16_t addr, uint16_t w) {
+    int a;
+
+    for (a = 0; a < flash_map_n; a++) {
+        if ((addr >= flash_map[a].addr)&&(addr < flash_map[a].addr + flash_map[a].n)) {
+            flash_map[a].obj[addr - flash_map[a].addr] = (uint8_t) w; //RETLW k
+        }
+    }
+}
+
+void sim_nop(void) {
+    uint16_t a, row;
+
+    sim_sync();
+    if (!NVMCON1bits.WR) return;
+    NVMCON1bits.WR = 0;
+    if (!NVMCON1bits.WREN) return;
+    row = NVMADR & ~31;
+    if (NVMCON1bits.FREE) {
+        for (a = 0; a < 32; a++) {
+            flash_store(row + a, 0x3FFF);
+            nvm_latch[a] = 0x3FFF;
+        }
+        return;
+    }
+    nvm_latch[NVMADR & 31] = NVMDAT & 0x3FFF;
+    if (NVMCON1bits.LWLO) return;
+    for (a = 0; a < 32; a++) {
+        flash_store(row + a, nvm_latch[a]);
+        nvm_latch[a] = 0x3FFF;
+    }
+}
+
+void sim_flash_map(uint16_t addr, void *obj, uint16_t n) {
+    flash_map[flash_map_n].addr = addr;
+    flash_map[flash_map_n].obj = obj;
+    flash_map[flash_map_n++].n = n;
+}
+
+//-------------------------------
+// Inputs
+//-------------------------------
+
+void sim_pin(char port, uint8_t bit, uint8_t level) {
+    level = level ? 1 : 0;
+    switch (port) {
+    case 'A':
+        if (bit == 0) RA0 = PORTAbits.RA0 = level;
+        if (bit == 1) RA1 = PORTAbits.RA1 = level;
+        if (bit == 2) RA2 = PORTAbits.RA2 = level;
+        if (bit == 4) RA4 = PORTAbits.RA4 = level;
+        if (bit == 5) RA5 = PORTAbits.RA5 = level;
+        break;
+    case 'B':
+        if (bit == 4) RB4 = PORTBbits.RB4 = level;
+        if (bit == 5) PORTBbits.RB5 = level;
+        if (bit == 6) RB6 = PORTBbits.RB6 = level;
+        if (bit == 7) RB7 = PORTBbits.RB7 = level;
+        break;
+    case 'C':
+        if (bit == 0) RC0 = PORTCbits.RC0 = level;
+        if (bit == 3) RC3 = PORTCbits.RC3 = level;
+        if (bit == 4) RC4 = PORTCbits.RC4 = level;
+        if (bit == 5) RC5 = PORTCbits.RC5 = level;
+        if (bit == 6) RC6 = PORTCbits.RC6 = level;
+        if (bit == 7) PORTCbits.RC7 = level;
+        break;
+    }
+}
+
+static void queue_add(uint64_t t, uint8_t kind) {
+    int a;
+
+    if (queue_n >= QUEUE_SIZE) {
+        fprintf(stderr, "sim: event queue full\n");
+        exit(2);
+    }
+    for (a = queue_n; (a > 0)&&(queue[a - 1].t > t); a--) queue[a] = queue[a - 1];
+    queue[a].t = t;
+    queue[a].kind = kind;
+    queue_n++;
+}
+
+void sim_edge(double t_us, SIM_EDGE_KIND kind) {
+    queue_add((uint64_t) llround(t_us * SIM_TICK_US), kind);
+}
+
+//Edges of kind in [t0, t1) are lost (pickup dropout)
+void sim_mask(SIM_EDGE_KIND kind, double t0_us, double t1_us) {
+    mask.kind = kind;
+    mask.t0 = (uint64_t) llround(t0_us * SIM_TICK_US);
+    mask.t1 = (uint64_t) llround(t1_us * SIM_TICK_US);
+}
+
+void sim_uart_rx(const char *s) {
+    while (*s) {
+        rx_q[rx_q_head] = *s++;
+        rx_q_head = (rx_q_head + 1) & 0xFF;
+    }
+}
+
+//-------------------------------
+// Engine
+//-------------------------------
+
+static void eng_push(double deg, double rpm) {
+    if (eng_n == eng_size) {
+        eng_size = eng_size ? eng_size * 2 : (1 << 20);
+        eng_deg = realloc(eng_deg, eng_size * sizeof (double));
+        eng_rpm = realloc(eng_rpm, eng_size * sizeof (double));
+    }
+    eng_deg[eng_n] = deg;
+    eng_rpm[eng_n++] = rpm;
+}
+
+void sim_engine(SIM_RPM_FN f, double pu1_deg) {
+    eng_fn = f;
+    eng_pu1 = pu1_deg;
+    eng_n = 0;
+    eng_push(0.0, f(0.0, 0.0));
+}
+
+//Edges of one target angle in (d0, d1]
+static void eng_cross(double d0, double d1, double target, uint64_t t0, uint8_t kind) {
+    double k, d;
+
+    k = floor((d1 - target) / 360.0);
+    d = target + 360.0 * k;
+    if (d > d0) {
+        queue_add(t0 + (uint64_t) llround((d - d0) / (d1 - d0) * SIM_TICK_US), kind);
+        if (sim_pu_n < SIM_SPARK_MAX) {
+            sim_pu[sim_pu_n].t = (double) t0 / SIM_TICK_US + (d - d0) / (d1 - d0);
+            sim_pu[sim_pu_n++].kind = kind;
+        }
+    }
+}
+
+//Crank angle of the next us and its edges
+static void eng_step(void) {
+    double t, d0, d1, r;
+    uint64_t t0;
+
+    t = (double) (eng_n - 1);
+    d0 = eng_deg[eng_n - 1];
+    r = eng_fn(t, d0);
+    d1 = d0 + r * 6e-6;
+    t0 = (uint64_t) (eng_n - 1) * SIM_TICK_US;
+    if (r > 0) {
+        eng_cross(d0, d1, 360.0 - eng_pu1, t0, SIM_EDGE_PU1);
+        eng_cross(d0, d1, 360.0 - SIM_PU2_BTDC, t0, SIM_EDGE_PU2);
+    }
+    eng_push(d1, r);
+}
+
+double sim_deg(double t_us) {
+    size_t i;
+    double f;
+
+    if ((eng_n == 0) || (t_us < 0)) return 0.0;
+    i = (size_t) t_us;
+    if (i + 1 >= eng_n) return eng_deg[eng_n - 1];
+    f = t_us - i;
+    return eng_deg[i] + (eng_deg[i + 1] - eng_deg[i]) * f;
+}
+
+double sim_btdc(double t_us) {
+    double d;
+
+    d = sim_deg(t_us);
+    return 360.0 * floor(d / 360.0 + 0.5) - d;
+}
+
+double sim_rpm(double t_us) {
+    size_t i;
+
+    i = (size_t) t_us;
+    if (i >= eng_n) i = eng_n - 1;
+    return eng_rpm[i];
+}
+
+//-------------------------------
+// Core
+//-------------------------------
+
+static void spark(uint8_t kind) {
+    if (sim_spark_n < SIM_SPARK_MAX) {
+        sim_spark[sim_spark_n].t = (double) now / SIM_TICK_US;
+        sim_spark[sim_spark_n++].kind = kind;
+    }
+}
+
+static uint8_t ccp2_compare(void) {
+    return (CCP2CON & 0x80)&&((CCP2CON & 0x0F) >= 0x08);
+}
+
+static void adc_convert(void) {
+    uint16_t v;
+
+    if (!ADCON0bits.ADON) return;
+    v = sim_adc[ADCON0bits.CHS] & 0x3FF;
+    ADRESH = v >> 8;
+    ADRESL = v & 0xFF;
+    ADIF = 1;
+}
+
+//Cycles to next TMR1 event (overflow or compare match)
+static uint64_t t1_next(void) {
+    uint32_t ps, n;
+
+    if (!t1_on) return UINT64_MAX;
+    ps = 1u << ((T1CON >> 4) & 0x03);
+    n = 0x10000 - t1;
+    if (ccp2_compare()) {
+        uint32_t c = ((uint16_t) (CCPR2 - t1 - 1)) + 1u;
+        if (c < n) n = c;
+    }
+    return (uint64_t) n * ps - t1_pre;
+}
+
+static void t1_advance(uint64_t cycles) {
+    uint32_t ps, inc, old;
+
+    if (!t1_on) return;
+    ps = 1u << ((T1CON >> 4) & 0x03);
+    inc = (uint32_t) ((t1_pre + cycles) / ps);
+    t1_pre = (uint32_t) ((t1_pre + cycles) % ps);
+    if (inc == 0) return;
+    old = t1;
+    t1 = (uint16_t) (old + inc);
+    if ((ccp2_compare())&&((uint16_t) (CCPR2 - old - 1) < inc)) {
+        CCP2IF = 1;
+        if ((CCP2CON & 0x0F) == 0x08) spark(SIM_SPARK_CCP2);
+        if (ADACT == 0x06) adc_convert();
+    }
+    if (old + inc > 0xFFFF) TMR1IF = 1;
+}
+
+static void edge(uint8_t kind) {
+    if ((kind == mask.kind)&&(now >= mask.t0)&&(now < mask.t1)) return;
+    switch (kind) {
+    case SIM_EDGE_PU1:
+        if (CCP1CON == 0x84) {
+            CCPR1 = t1;
+            CCP1IF = 1;
+        }
+        break;
+    case SIM_EDGE_PU2:
+        if (LATC2 == 0) spark(SIM_SPARK_PU2);
+        if (IOCAN2) IOCAF2 = 1;
+        break;
+    case SIM_EDGE_QS:
+        if (IOCBN4) IOCBF4 = 1;
+        break;
+    case SIM_EDGE_LAUNCH:
+        if (IOCAP1 || IOCAN1) IOCAF1 = 1;
+        break;
+    }
+}
+
+static uint8_t isr_pending(void) {
+    if (!GIE) return 0;
+    if (CCP1IF && CCP1IE) return 1;
+    if (!PEIE) return 0;
+    return (CCP2IF && CCP2IE) || (TMR1IF && TMR1IE) || (ADIF && ADIE) || (RC1IF && RC1IE)
+            || (IOCIE && (IOCAF1 || IOCAF2 || IOCBF4));
+}
+
+//Advance to t, one event at a time. isr: enter the ISR on pending flags
+static void advance_to(uint64_t t, uint8_t isr) {
+    uint64_t next, n;
+
+    while (1) {
+        if ((isr)&&(!in_isr)&&(isr_pending())) {
+            advance_to(now + SIM_ISR_ENTRY, 0);
+            in_isr = 1;
+            sim_isr_n++;
+            InterruptManager();
+            sim_sync();
+            RC1IF = 0;
+            in_isr = 0;
+            continue;
+        }
+        if (now >= t) break;
+        if ((rx_q_tail != rx_q_head)&&(!RC1IF)&&(sim_rc1sta.CREN)) {
+            RC1REG = (uint8_t) rx_q[rx_q_tail];
+            rx_q_tail = (rx_q_tail + 1) & 0xFF;
+            RC1IF = 1;
+            continue;
+        }
+        next = t;
+        if ((eng_fn)&&((uint64_t) (eng_n - 1) * SIM_TICK_US < next)) next = (uint64_t) (eng_n - 1) * SIM_TICK_US;
+        if ((queue_n)&&(queue[0].t < next)) next = queue[0].t;
+        n = t1_next();
+        if ((n != UINT64_MAX)&&(now + n < next)) next = now + n;
+        if ((T2CON & 0x80)&&(ADACT == 0x04)&&(adc_next < next)) next = adc_next;
+        if (next < now) next = now;
+        n = next - now;
+        now = next; //Compare match of t1_advance() is at the end of the step
+        t1_advance(n);
+        t1_shadow = t1;
+        if ((eng_fn)&&((uint64_t) (eng_n - 1) * SIM_TICK_US <= now)) eng_step();
+        while ((queue_n)&&(queue[0].t <= now)) {
+            uint8_t kind = queue[0].kind;
+            memmove(&queue[0], &queue[1], (queue_n - 1) * sizeof (queue[0]));
+            queue_n--;
+            edge(kind);
+        }
+        if (adc_next <= now) {
+            if ((T2CON & 0x80)&&(ADACT == 0x04)) adc_convert();
+            adc_next += 4096 * SIM_TICK_US;
+        }
+    }
+}
+
+void sim_run(double t_us) {
+    sim_sync();
+    advance_to((uint64_t) llround(t_us * SIM_TICK_US), 1);
+    sim_trmt();
+}
+
+double sim_now(void) {
+    return (double) now / SIM_TICK_US;
+}
+
+void sim_init(void) {
+    now = 0;
+    in_isr = 0;
+    t1 = 0;
+    t1_on = 0;
+    t1_pre = 0;
+    t1_shadow = 0;
+    t1on_shadow = 0;
+    T1CON = 0;
+    t1con_seen = 0;
+    latc1 = 0;
+    latc1_shadow = 0;
+    queue_n = 0;
+    mask.t1 = 0;
+    eng_fn = NULL;
+    eng_n = 0;
+    sim_spark_n = 0;
+    sim_pu_n = 0;
+    sim_tx_n = 0;
+    sim_isr_n = 0;
+    rx_q_head = rx_q_tail = 0;
+    adc_next = 4096 * SIM_TICK_US;
+    flash_map_n = 0;
+    TX1REG = -1;
+}
@@ -0,0 +1,76 @@
+/*--------------------------------------------------------------------------
+ PIC16F15245 / engine simulator for host tests
+------------------------------------------------------------------------- */
+
+/*
+ Time runs in instruction cycles (Fosc/4 = 8MHz, 0.125us). Modelled:
+   TMR1 with prescaler, overflow (TMR1IF) and CCP2 compare match (CCP2IF,
+   a digital spark), CCP1 capture of PU1 edges, IOC of PU2 / launch switch /
+   quick shifter, the PU2 analog spark while IGEN is low, the TMR2 triggered
+   ADC (sim_adc[] per channel), UART RX/TX and the flash row erase/write of
+   cal_write_row(). The ISR is entered SIM_ISR_ENTRY cycles after its flag.
+ Firmware code takes no time, only __delay_us() does.
+ The engine is a crank angle integrated every 1us from a rpm function.
+ PU1 is at pu1_deg (deg BTDC) and PU2 at 5deg BTDC on every revolution.
+ Extra edges are injected by sim_edge(), engine edges dropped by sim_mask().
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "xc.h"
+
+#define SIM_TICK_US         (8)     //Cycles per us
+#define SIM_ISR_ENTRY       (8)     //Flag to first ISR instruction (cycles)
+#define SIM_PU2_BTDC        (5.0)   //deg
+#define SIM_SPARK_MAX       (100000)
+
+typedef enum {
+    SIM_SPARK_CCP2,     //CCP2 compare match
+    SIM_SPARK_SOFT,     //IGOUT set by software
+    SIM_SPARK_PU2,      //PU2 analog ignition (IGEN low at PU2)
+} SIM_SPARK_KIND;
+
+typedef enum {
+    SIM_EDGE_PU1,
+    SIM_EDGE_PU2,
+    SIM_EDGE_QS,        //RB4 falling
+    SIM_EDGE_LAUNCH,    //RA1 change
+} SIM_EDGE_KIND;
+
+typedef struct {
+    double t;           //us
+    uint8_t kind;
+} SIM_EVENT;
+
+typedef double (*SIM_RPM_FN)(double t_us, double deg);
+
+extern SIM_EVENT sim_spark[SIM_SPARK_MAX];
+extern int sim_spark_n;
+extern SIM_EVENT sim_pu[SIM_SPARK_MAX];    //Engine PU1/PU2 edges
+extern int sim_pu_n;
+extern uint16_t sim_adc[64];
+extern char sim_tx[4096];
+extern int sim_tx_n;
+extern int sim_isr_n;
+extern int sim_reset_n;
+
+void sim_init(void);
+void sim_flash_map(uint16_t addr, void *obj, uint16_t n);
+void sim_pin(char port, uint8_t bit, uint8_t level);
+void sim_engine(SIM_RPM_FN f, double pu1_deg);
+void sim_edge(double t_us, SIM_EDGE_KIND kind);
+void sim_mask(SIM_EDGE_KIND kind, double t0_us, double t1_us);
+void sim_uart_rx(const char *s);
+void sim_run(double t_us);
+double sim_now(void);
+double sim_deg(double t_us);
+double sim_btdc(double t_us);
+double sim_rpm(double t_us);
+
+#endif
@@ -0,0 +1,135 @@
+/*--------------------------------------------------------------------------
+ Host stand-in for <xc.h> (PIC16F15245)
+------------------------------------------------------------------------- */
+
+/*
+ Registers are plain variables, except the ones the simulator must see
+ change while firmware code runs: TMR1 (counts with simulated time), the
+ IGOUT latch (a spark), the NVM write start and the UART transmit register.
+ Those are accessor macros that return a pointer. A write through it is
+ taken by the simulator at the next register access, __delay_us(), or when
+ the ISR returns, which is the same instant in simulated time, as firmware
+ code between delays takes no time here.
+ uint24_t is 32bit on the host. The firmware keeps its 24bit values in range.
+ */
+
+#ifndef SIM_XC_H
+#define SIM_XC_H
+
+#include <stdint.h>
+
+typedef uint32_t uint24_t;
+typedef int32_t int24_t;
+
+#define __interrupt(...)
+#define __at(x)
+#define __delay_us(x)       sim_delay_us(x)
+#define __delay_ms(x)       sim_delay_us((x) * 1000UL)
+#define CLRWDT()            ((void) 0)
+#define SLEEP()             ((void) 0)
+#define NOP()               sim_nop()
+#define RESET()             sim_reset()
+
+void sim_delay_us(uint32_t us);
+void sim_nop(void);
+void sim_reset(void);
+volatile uint16_t *sim_tmr1(void);
+volatile uint8_t *sim_tmr1h(void);
+volatile uint8_t *sim_tmr1l(void);
+volatile uint8_t *sim_tmr1on(void);
+volatile uint8_t *sim_tmr0l(void);
+volatile uint8_t *sim_latc1(void);
+uint8_t sim_trmt(void);
+
+//TMR1 and TMR0
+#define TMR1                (*sim_tmr1())
+#define TMR1H               (*sim_tmr1h())
+#define TMR1L               (*sim_tmr1l())
+#define TMR1ON              (*sim_tmr1on())
+#define TMR0L               (*sim_tmr0l())
+extern volatile uint8_t T1CON, T1CLK, TMR1IF, TMR1IE;
+extern volatile uint8_t T0CON0, T0CON1, TMR0H, TMR0IF;
+extern volatile uint8_t T2CON, T2CLKCON, T2PR;
+
+//CCP and PWM
+extern volatile uint16_t CCPR1, CCPR2;
+extern volatile uint8_t CCP1CON, CCP2CON, CCP1CAP, CCP2CAP;
+extern volatile uint8_t CCP1IF, CCP2IF, CCP1IE, CCP2IE;
+extern volatile uint8_t PWM3CON, PWM3DCH, PWM3DCL, PWM4CON, PWM4DCH, PWM4DCL;
+
+//Ports. Input pins are set by the test with sim_pin(), which keeps the
+//short names and PORTxbits alike
+typedef struct {
+    unsigned RA0 : 1, RA1 : 1, RA2 : 1, RA3 : 1, RA4 : 1, RA5 : 1, RA6 : 1, RA7 : 1;
+} PORTAbits_t;
+typedef struct {
+    unsigned RB0 : 1, RB1 : 1, RB2 : 1, RB3 : 1, RB4 : 1, RB5 : 1, RB6 : 1, RB7 : 1;
+} PORTBbits_t;
+typedef struct {
+    unsigned RC0 : 1, RC1 : 1, RC2 : 1, RC3 : 1, RC4 : 1, RC5 : 1, RC6 : 1, RC7 : 1;
+} PORTCbits_t;
+extern volatile PORTAbits_t PORTAbits;
+extern volatile PORTBbits_t PORTBbits;
+extern volatile PORTCbits_t PORTCbits;
+extern volatile uint8_t RA0, RA1, RA2, RA4, RA5, RB4, RB6, RB7, RC0, RC3, RC4, RC5, RC6;
+#define LATC1               (*sim_latc1())
+extern volatile uint8_t PORTA, PORTB, PORTC, LATA, LATB, LATC, LATA0, LATC2, LATC3;
+extern volatile uint8_t TRISA, TRISB, TRISC, ANSELA, ANSELB, ANSELC;
+extern volatile uint8_t INLVLA, INLVLB, INLVLC, WPUA, WPUB, WPUC;
+
+//Interrupt on change
+extern volatile uint8_t IOCIE, IOCAF1, IOCAP1, IOCAN1, IOCAF2, IOCAN2, IOCBF4, IOCBN4;
+
+//Interrupt control
+extern volatile uint8_t GIE, PEIE, PIR0, PIR1, PIR2;
+
+//PPS
+typedef struct {
+    unsigned PPSLOCKED : 1;
+} PPSLOCKbits_t;
+extern volatile PPSLOCKbits_t PPSLOCKbits;
+extern volatile uint8_t PPSLOCK, CCP1PPS, CCP2PPS, RC1PPS, RX1PPS, RB6PPS, RA0PPS, RC3PPS;
+
+//Oscillator, WDT, stack
+extern volatile uint8_t OSCEN, OSCFRQ, OSCTUNE, WDTCON, STKPTR;
+
+//ADC. The simulator converts sim_adc[channel] at each TMR2 period
+typedef union {
+    uint8_t v;
+    struct {
+        unsigned ADON : 1, GO_nDONE : 1, CHS : 6;
+    };
+} ADCON0_t;
+extern volatile ADCON0_t sim_adcon0;
+#define ADCON0              sim_adcon0.v
+#define ADCON0bits          sim_adcon0
+extern volatile uint8_t ADCON1, ADACT, ADRESH, ADRESL, ADIF, ADIE;
+
+//UART
+typedef union {
+    uint8_t v;
+    struct {
+        unsigned RX9D : 1, OERR : 1, FERR : 1, ADDEN : 1, CREN : 1, SREN : 1, RX9 : 1, SPEN : 1;
+    };
+} RC1STA_t;
+extern volatile RC1STA_t sim_rc1sta;
+#define RC1STA              sim_rc1sta.v
+#define RC1STAbits          sim_rc1sta
+#define TRMT                sim_trmt()
+extern volatile int16_t TX1REG;             //-1: nothing written
+extern volatile uint8_t RC1REG, RC1IF, RC1IE, TX1STA, BAUD1CON, SP1BRGL, SP1BRGH;
+
+//NVM
+typedef union {
+    uint8_t v;
+    struct {
+        unsigned RD : 1, WR : 1, WREN : 1, WRERR : 1, FREE : 1, LWLO : 1, NVMREGS : 1, b7 : 1;
+    };
+} NVMCON1_t;
+extern volatile NVMCON1_t sim_nvmcon1;
+#define NVMCON1             sim_nvmcon1.v
+#define NVMCON1bits         sim_nvmcon1
+extern volatile uint16_t NVMADR, NVMDAT;
+extern volatile uint8_t NVMCON2;
+
+#endif
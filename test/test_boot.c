@@ -0,0 +1,107 @@
+/*--------------------------------------------------------------------------
+ Boot to armed test
+------------------------------------------------------------------------- */
+
+/*
+ The engine turns from power on (kick start, or a reset while running, under
+ the main rev limitter) and
+ calc_map() takes its cycle model time of fw.h with the map still unbuilt. PU1 capture is armed at the top of
+ initialize_ignition(). Until ig_map_ready no digital spark may fire, every
+ PU2 edge fires PU2 analog. After it every revolution from the third on fires
+ one digital spark at the map angle (PU2 analog still follows in the map
+ range). boot_ticks must read the boot time.
+ Reported: map ready time, boot_ticks and the first digital spark.
+ While stopped the main loop must not scan the switches: REV_SEL changed
+ after boot is taken only by the first loop after the engine starts.
+ */
+
+#include "fw.h"
+
+#define REVS                (12)
+#define ANGLE_TOL           (0.1)   //deg
+
+static void run(void *arg) {
+    double r, t_ready, t_dig, p, t, target, d;
+    double pu1[REVS + 4];
+    int a, e, n, an, dig;
+    uint16_t b;
+
+    r = *(const double *) arg;
+    p = 60e6 / r;
+    fw_const_rpm = r;
+    fw_boot_engine = fw_rpm_const;
+    fw_boot();
+    t_ready = sim_now();
+    sim_run(t_ready + REVS * p);
+
+    an = 0;
+    t_dig = 0;
+    for (e = 0; e < sim_spark_n; e++) {
+        if (sim_spark[e].kind == SIM_SPARK_PU2) {
+            if (sim_spark[e].t < t_ready) an++;
+        } else {
+            CHECK(sim_spark[e].t >= t_ready, "%.0frpm: digital spark at %.0fus, maps ready at %.0fus", r, sim_spark[e].t, t_ready);
+            if (t_dig == 0) t_dig = sim_spark[e].t;
+        }
+    }
+    for (n = 0, a = 0; a < sim_pu_n; a++) {
+        if ((sim_pu[a].kind == SIM_EDGE_PU2)&&(sim_pu[a].t < t_ready)) n++;
+    }
+    CHECK(an == n, "%.0frpm: %d PU2 analog sparks for %d PU2 edges before the maps", r, an, n);
+
+    n = 0;
+    for (a = 0; (a < sim_pu_n)&&(n < REVS + 4); a++) {
+        if ((sim_pu[a].kind == SIM_EDGE_PU1)&&(sim_pu[a].t >= t_ready)) pu1[n++] = sim_pu[a].t;
+    }
+    b = (uint16_t) (r / RPM_BIN_WIDTH);
+    target = (b < FIXED_IG_RPM) ? crank_deg_table[(b * RPM_BIN_WIDTH) / 100] / 100.0 : fw_map_deg(b);
+    target += LAT_US(b) * r * 6e-6;
+    for (a = 2; a < n - 1; a++) {
+        dig = 0;
+        t = 0;
+        for (e = 0; e < sim_spark_n; e++) {
+            if ((sim_spark[e].t < pu1[a]) || (sim_spark[e].t >= pu1[a + 1])) continue;
+            if (sim_spark[e].kind == SIM_SPARK_PU2) continue;
+            dig++;
+            t = sim_spark[e].t;
+        }
+        CHECK(dig == 1, "%.0frpm rev %d: %d sparks", r, a, dig);
+        d = sim_btdc(t);
+        CHECK(fabs(d - target) <= ANGLE_TOL, "%.0frpm rev %d: spark %.3fdeg, map %.3fdeg", r, a, d, target);
+    }
+    printf("%5.0frpm: maps ready %.0fus, boot_ticks %u (%uus), %d PU2 analog sparks before, first digital spark %.0fus\n",
+            r, t_ready, boot_ticks, boot_ticks * 32, an, t_dig);
+    CHECK(fabs(boot_ticks * 32.0 - t_ready) <= 32.0, "%.0frpm: boot_ticks %u, boot %.0fus", r, boot_ticks, t_ready);
+}
+
+static void stopped(void *arg) {
+    int k;
+
+    (void) arg;
+    fw_boot();
+    CHECK(revlimit_state == REVLIMIT_ENABLE, "boot: revlimit_state %u", revlimit_state);
+    sim_pin('A', 4, 0);
+    for (k = 0; k < 16; k++) {
+        sim_run(sim_now() + 1000);
+        fw_loop();
+    }
+    CHECK(revlimit_state == REVLIMIT_ENABLE, "stopped: switch scanned, revlimit_state %u", revlimit_state);
+    fw_const_rpm = 1000;
+    sim_engine(fw_rpm_const, param.pu1_deg / 100.0);
+    sim_run(sim_now() + 3 * 60e3);
+    fw_loop();
+    CHECK(revlimit_state == REVLIMIT_DISABLE, "running: revlimit_state %u", revlimit_state);
+}
+
+int main(void) {
+    static const double test_rpm[] = {300, 1000, 3000, 6000, 9000};
+    unsigned a;
+
+    printf("calc_map() %.0fus (cycle model)\n", CY_CALC_MAP / CY_US);
+    for (a = 0; a < sizeof (test_rpm) / sizeof (test_rpm[0]); a++) {
+        fw_fork(run, (void *) &test_rpm[a]);
+    }
+    fw_fork(stopped, NULL);
+    printf("PASS\n");
+    return 0;
+}
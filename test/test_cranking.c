@@ -0,0 +1,121 @@
+/*--------------------------------------------------------------------------
+ Cranking map test, 200-1500rpm
+------------------------------------------------------------------------- */
+
+/*
+ 1. Constant rpm from 200 to 1500rpm, TMR1 overflowing up to 4 times a
+    period. From the third PU1 on, every revolution must have exactly one
+    digital spark (CCP2 or software) and no PU2 analog spark, at the
+    crank_deg_table angle. The engine runs 1rpm above a bin, so the map
+    bin is its speed. The spark is LAT_US() early by design (the latency
+    is in the hardware, not in the simulator).
+ 2. Kick start: 150 to 1700rpm in 1.5s. Exactly one digital spark per
+    revolution from the third PU1 on while the last period is on the
+    cranking map. Above FIXED_IG_RPM the map and PU2 both fire at about
+    PU2_deg; the first of them discharges the CDI, so only a spark is
+    required there.
+ */
+
+#include "fw.h"
+
+#define ANGLE_TOL           (0.3)   //deg
+
+static double ramp_rpm(double t_us, double deg) {
+    (void) deg;
+    if (t_us > 1.5e6) return 1700.0;
+    return 150.0 + 1550.0 * t_us / 1.5e6;
+}
+
+//Sparks in [t0, t1). kind of the last one, -1 for none
+static int sparks_in(double t0, double t1, int *kind, double *t) {
+    int a, n;
+
+    n = 0;
+    *kind = -1;
+    for (a = 0; a < sim_spark_n; a++) {
+        if ((sim_spark[a].t >= t0)&&(sim_spark[a].t < t1)) {
+            n++;
+            *kind = sim_spark[a].kind;
+            *t = sim_spark[a].t;
+        }
+    }
+    return n;
+}
+
+static int pu1_times(double *t, int max) {
+    int a, n;
+
+    n = 0;
+    for (a = 0; (a < sim_pu_n)&&(n < max); a++) {
+        if (sim_pu[a].kind == SIM_EDGE_PU1) t[n++] = sim_pu[a].t;
+    }
+    return n;
+}
+
+static void run_const(void *arg) {
+    double r = *(double *) arg;
+    double pu1[16], ts, target, btdc, err, max_err;
+    uint16_t bin;
+    int a, n, kind;
+
+    fw_boot();
+    fw_const_rpm = r;
+    sim_engine(fw_rpm_const, param.pu1_deg / 100.0);
+    sim_run(8.5 * 60e6 / r);
+    n = pu1_times(pu1, 16);
+    CHECK(n >= 8, "%d PU1 edges", n);
+    read_snapshot();
+    CHECK(eg_view.EG_state == EG_CRANKING, "state %u", eg_view.EG_state);
+    bin = (uint16_t) (r / RPM_BIN_WIDTH);
+    target = crank_deg_table[(bin * RPM_BIN_WIDTH) / 100] / 100.0 + LAT_US(bin) * r * 6e-6;
+    btdc = 0;
+    max_err = 0;
+    for (a = 2; a < n - 1; a++) {
+        CHECK(sparks_in(pu1[a], pu1[a + 1], &kind, &ts) == 1, "%.0frpm rev %d: %d sparks", r, a, sparks_in(pu1[a], pu1[a + 1], &kind, &ts));
+        CHECK(kind != SIM_SPARK_PU2, "%.0frpm rev %d: PU2 analog spark", r, a);
+        btdc = sim_btdc(ts);
+        err = fabs(btdc - target);
+        if (err > max_err) max_err = err;
+        CHECK(err <= ANGLE_TOL, "%.0frpm rev %d: spark %.2fdeg BTDC, map %.2fdeg", r, a, btdc, target);
+    }
+    printf("%5.0frpm: %d revolutions, spark %.2fdeg BTDC (map %.2f + latency), max error %.3fdeg\n",
+            r, n - 3, btdc, crank_deg_table[(bin * RPM_BIN_WIDTH) / 100] / 100.0, max_err);
+}
+
+static void run_ramp(void *arg) {
+    double pu1[64], ts, r;
+    int a, n, kind, digital;
+
+    (void) arg;
+    fw_boot();
+    sim_engine(ramp_rpm, param.pu1_deg / 100.0);
+    sim_run(2.0e6);
+    n = pu1_times(pu1, 64);
+    CHECK(n >= 20, "%d PU1 edges", n);
+    digital = 0;
+    for (a = 2; a < n - 1; a++) {
+        r = 60e6 / (pu1[a] - pu1[a - 1]);
+        if (r >= FIXED_IG_RPM * RPM_BIN_WIDTH) {
+            CHECK(sparks_in(pu1[a], pu1[a + 1], &kind, &ts) >= 1, "ramp rev %d (%.0frpm): no spark", a, r);
+            continue;
+        }
+        digital++;
+        CHECK(sparks_in(pu1[a], pu1[a + 1], &kind, &ts) == 1, "ramp rev %d (%.0frpm): %d sparks", a, r, sparks_in(pu1[a], pu1[a + 1], &kind, &ts));
+        CHECK(kind != SIM_SPARK_PU2, "ramp rev %d (%.0frpm): PU2 analog spark", a, r);
+    }
+    read_snapshot();
+    CHECK(eg_view.EG_state == EG_RUNNING, "state %u", eg_view.EG_state);
+    printf("kick start 150-1700rpm: %d revolutions, %d on the cranking map, one digital spark each\n", n - 3, digital);
+}
+
+int main(void) {
+    double test_rpm[] = {201, 251, 301, 451, 601, 801, 951, 1001, 1251, 1451};
+    unsigned a;
+
+    for (a = 0; a < sizeof (test_rpm) / sizeof (test_rpm[0]); a++) {
+        fw_fork(run_const, &test_rpm[a]);
+    }
+    fw_fork(run_ramp, NULL);
+    printf("PASS\n");
+    return 0;
+}
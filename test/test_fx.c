@@ -0,0 +1,159 @@
+/*--------------------------------------------------------------------------
+ Fixed point kernel test
+------------------------------------------------------------------------- */
+
+/*
+ Bit exact against the plain C expression of the Fixed point kernels block:
+   - fx_mulh16x8: every a x b
+   - fx_mulh16x16: every a at b = 0, powers of two and their neighbours,
+     0x7FFF/0x8000/0xFFFF, every b at the same a, and RANDOM xorshift pairs
+   - fx_recip16: every x, within 1/4096 + 1 of 65536 / x, 0xFFFF for 0 and 1
+   - fx_divf16: every n at d = 2^22 + 1 and 0xFFFF + 1, every d < 2^16 at
+     n = d - 1, d / 2 and d / 4, and RANDOM pairs
+   - period_rpm: every period from t1_ps_min_period to 2^24 of each stage
+   - fx_adds16: every a at b = 0, +-1, +-powers of two, -32768, 32767, and
+     RANDOM pairs
+ Reported: the worst fx_recip16 error.
+ */
+
+#include "fw.h"
+
+#define RANDOM              (1UL << 24)
+
+static uint32_t rnd_s = 0x12345678;
+
+static uint32_t rnd(void) {
+    rnd_s ^= rnd_s << 13;
+    rnd_s ^= rnd_s >> 17;
+    rnd_s ^= rnd_s << 5;
+    return rnd_s;
+}
+
+static uint16_t edge[64];
+static int edge_n;
+
+static void edge_add(uint32_t v) {
+    edge[edge_n++] = (uint16_t) v;
+}
+
+static void mulh16x16_check(uint16_t a, uint16_t b) {
+    uint16_t y;
+
+    y = fx_mulh16x16(a, b);
+    CHECK(y == (uint16_t) (((uint32_t) a * b) >> 16), "fx_mulh16x16(0x%04X, 0x%04X) = 0x%04X", a, b, y);
+}
+
+static void divf16_check(uint32_t n, uint32_t d) {
+    uint16_t y;
+
+    y = fx_divf16(n, d);
+    CHECK(y == (uint16_t) (((uint64_t) n << 16) / d), "fx_divf16(%lu, %lu) = 0x%04X",
+            (unsigned long) n, (unsigned long) d, y);
+}
+
+static void adds16_check(uint16_t a, int16_t b) {
+    int32_t s;
+    uint16_t y;
+
+    s = (int32_t) a + b;
+    s = (s < 0) ? 0 : (s > 0xFFFF) ? 0xFFFF : s;
+    y = fx_adds16(a, b);
+    CHECK(y == s, "fx_adds16(%u, %d) = %u", a, b, y);
+}
+
+int main(void) {
+    uint32_t a, b, k;
+    uint16_t y;
+    double e, tol, max, rel;
+    uint16_t x_max;
+
+    edge_n = 0;
+    edge_add(0);
+    for (k = 0; k < 16; k++) {
+        edge_add((1UL << k) - 1);
+        edge_add(1UL << k);
+        edge_add((1UL << k) + 1);
+    }
+    edge_add(0x7FFF);
+    edge_add(0xFFFE);
+    edge_add(0xFFFF);
+
+    for (a = 0; a < 0x10000; a++) {
+        for (b = 0; b < 0x100; b++) {
+            y = fx_mulh16x8((uint16_t) a, (uint8_t) b);
+            CHECK(y == (uint16_t) ((a * b) >> 8), "fx_mulh16x8(0x%04X, 0x%02X) = 0x%04X", a, b, y);
+        }
+    }
+    printf("fx_mulh16x8: %lu pairs exact\n", 0x10000UL * 0x100);
+
+    for (a = 0; a < 0x10000; a++) {
+        for (k = 0; k < (uint32_t) edge_n; k++) {
+            mulh16x16_check((uint16_t) a, edge[k]);
+            mulh16x16_check(edge[k], (uint16_t) a);
+        }
+    }
+    for (k = 0; k < RANDOM; k++) {
+        b = rnd();
+        mulh16x16_check((uint16_t) b, (uint16_t) (b >> 16));
+    }
+    printf("fx_mulh16x16: %lu pairs exact\n", 0x10000UL * 2 * edge_n + RANDOM);
+
+    CHECK(fx_recip16(0) == 0xFFFF, "fx_recip16(0) = 0x%04X", fx_recip16(0));
+    CHECK(fx_recip16(1) == 0xFFFF, "fx_recip16(1) = 0x%04X", fx_recip16(1));
+    max = rel = 0;
+    x_max = 0;
+    for (a = 2; a < 0x10000; a++) {
+        y = fx_recip16((uint16_t) a);
+        e = fabs(y - 65536.0 / a);
+        tol = 65536.0 / a / 4096.0 + 1.0;
+        CHECK(e <= tol, "fx_recip16(%u) = %u, 65536/x %.3f", a, y, 65536.0 / a);
+        if (e > max) {
+            max = e;
+            x_max = (uint16_t) a;
+        }
+        if (e - 1.0 > rel * 65536.0 / a) rel = (e - 1.0) / (65536.0 / a);
+    }
+    printf("fx_recip16: x 2-65535 in 1/4096 + 1, worst %.3f at x %u, relative over 1 count %.6f (1/%.0f)\n",
+            max, x_max, rel, (rel > 0) ? 1.0 / rel : 0.0);
+
+    for (a = 0; a < 0x10000; a++) {
+        divf16_check(a, (1UL << 22) + 1);
+        divf16_check(a, 0x10000);
+        if (a < 2) continue;
+        divf16_check(a - 1, a);
+        divf16_check(a / 2, a);
+        divf16_check(a / 4, a);
+    }
+    for (k = 0; k < RANDOM; k++) {
+        a = rnd() & 0x7FFFFF;
+        b = rnd() % (a + 1);
+        if (b < a) divf16_check(b, a);
+    }
+    printf("fx_divf16: exact\n");
+
+    for (k = 0; k < T1_PS_STAGES; k++) {
+        CHECK(period_rpm(t1_ps_min_period[k] - 1, k) == MAX_MAP_RPM + 1, "period_rpm() under min period");
+        for (a = t1_ps_min_period[k]; a < (1UL << 24); a++) {
+            y = period_rpm(a, k);
+            CHECK(y == t1_ps_rpm_num[k] / a, "period_rpm(%lu, %lu) = %u", (unsigned long) a, (unsigned long) k, y);
+        }
+    }
+    printf("period_rpm: exact\n");
+
+    for (a = 0; a < 0x10000; a++) {
+        adds16_check((uint16_t) a, 0);
+        adds16_check((uint16_t) a, -32768);
+        adds16_check((uint16_t) a, 32767);
+        for (k = 0; k < 15; k++) {
+            adds16_check((uint16_t) a, (int16_t) (1 << k));
+            adds16_check((uint16_t) a, (int16_t) -(1 << k));
+        }
+    }
+    for (k = 0; k < RANDOM; k++) {
+        b = rnd();
+        adds16_check((uint16_t) b, (int16_t) (b >> 16));
+    }
+    printf("fx_adds16: saturation exact\n");
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*--------------------------------------------------------------------------
+ PU2 limp test
+------------------------------------------------------------------------- */
+
+/*
+ The engine runs at constant rpm until PU1 is lost for good (masked). The
+ first PU2 edge after that is still in the period of the last PU1, the
+ second enters EG_LIMP on PU2 and the third, with IGEN still on from the
+ second, fires PU2 analog and digital. From the fourth every PU2 edge must give
+ exactly one spark, digital (CCP2 or software, IGEN off), limp_ret_table of
+ the rpm band after PU2. Bands 0/1 have no retard and fire by software at
+ the edge. One rpm in each of the first bands. Limp is entered from
+ EG_RUNNING only, so the lowest one runs at 2000rpm until PU1 is lost and
+ slows down in limp.
+ */
+
+#include "fw.h"
+
+#define REVS                (24)
+#define LOST_REV            (8)     //PU1 masked from this revolution on
+#define ANGLE_TOL           (0.1)   //deg. Software PU2 timestamp, ISR entry
+#define RUN_RPM             (2001.0)
+
+typedef struct {
+    double run;             //rpm until PU1 is lost
+    double limp;            //rpm after
+} CASE;
+
+static double t_lost;
+static const CASE *cs;
+
+static double step_rpm(double t_us, double deg) {
+    (void) deg;
+    return (t_us < t_lost) ? cs->run : cs->limp;
+}
+
+static void run(void *arg) {
+    double r;
+    double pu2[REVS + 4], t, target, d, max;
+    int a, e, n, dig, kind;
+    uint16_t b;
+
+    cs = arg;
+    r = cs->limp;
+    t_lost = LOST_REV * 60e6 / cs->run;
+    fw_boot();
+    sim_pin('A', 4, 0); //Main rev limitter off
+    check_sw_state();
+    sim_engine(step_rpm, param.pu1_deg / 100.0);
+    sim_mask(SIM_EDGE_PU1, t_lost, 1e12);
+    sim_run(t_lost + (REVS - LOST_REV) * 60e6 / r);
+    read_snapshot();
+    CHECK(eg_view.EG_state == EG_LIMP, "%.0frpm: state %u", r, eg_view.EG_state);
+    n = 0;
+    for (a = 0; (a < sim_pu_n)&&(n < REVS + 4); a++) {
+        if ((sim_pu[a].kind == SIM_EDGE_PU2)&&(sim_pu[a].t > t_lost)) pu2[n++] = sim_pu[a].t;
+    }
+    CHECK(n >= REVS - LOST_REV - 2, "%.0frpm: %d PU2 edges", r, n);
+    b = (uint16_t) (r / RPM_BIN_WIDTH);
+    target = SIM_PU2_BTDC - limp_ret_table[b / LIMP_RPM_STEP] * r * 6e-6;
+    max = 0;
+    for (a = 3; a < n - 1; a++) {
+        dig = kind = 0;
+        t = 0;
+        for (e = 0; e < sim_spark_n; e++) {
+            if ((sim_spark[e].t < pu2[a]) || (sim_spark[e].t >= pu2[a + 1])) continue;
+            CHECK(sim_spark[e].kind != SIM_SPARK_PU2, "%.0frpm PU2 %d: PU2 analog spark", r, a);
+            dig++;
+            kind = sim_spark[e].kind;
+            t = sim_spark[e].t;
+        }
+        CHECK(dig == 1, "%.0frpm PU2 %d: %d sparks", r, a, dig);
+        d = fabs(sim_btdc(t) - target);
+        if (d > max) max = d;
+        CHECK(d <= ANGLE_TOL, "%.0frpm PU2 %d: spark %.3fdeg BTDC, limp %.3fdeg", r, a, sim_btdc(t), target);
+    }
+    printf("%5.0frpm band %u: %d PU2 edges, %s spark %.2fdeg BTDC (PU2 %.1f - %u counts), max error %.3fdeg\n",
+            r, b / LIMP_RPM_STEP, n - 4, (kind == SIM_SPARK_CCP2) ? "CCP2" : "software", sim_btdc(t),
+            SIM_PU2_BTDC, limp_ret_table[b / LIMP_RPM_STEP], max);
+}
+
+int main(void) {
+    static const CASE test_case[] = {
+        {RUN_RPM, 1201}, {RUN_RPM, RUN_RPM}, {3001, 3001}, {4001, 4001}, {6001, 6001}
+    };
+    unsigned a;
+
+    for (a = 0; a < sizeof (test_case) / sizeof (test_case[0]); a++) {
+        fw_fork(run, (void *) &test_case[a]);
+    }
+    printf("PASS\n");
+    return 0;
+}
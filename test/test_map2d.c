@@ -0,0 +1,215 @@
+/*--------------------------------------------------------------------------
+ rpm x TPS ignition map benchmark and calibration command test
+------------------------------------------------------------------------- */
+
+/*
+ 1. Accuracy: ig_map_wait() of every map bin, after ig_map_col() at each
+    TPS 0-255 and pot 0/128/255, against the exact bilinear angle of
+    ig_map_2d turned into a waiting time in double. ig_map_col() must
+    leave the ig_col[] buffer the ISR reads untouched and switch to the
+    other one.
+    Reported as angle: worst of ig_col[] (TPS and pot step), of
+    ig_map_wait(), and of ig_map_wait() against the same exact angle through
+    deg2time_coeff, which leaves only the fixed point arithmetic. The rest
+    is the rounding of deg2time_coeff, shared with the switch curve map.
+ 2. WCET: the firmware runs in zero time on the host, so it is costed by
+    the cycle model of fw.h. ig_map_wait() runs in stage 2 of every
+    revolution: priced per bin by the ig_rpm_axis segments its search
+    passes, the worst must stay under ISR_SHARE of a revolution at
+    MAX_MAP_RPM. The main loop pays ig_map_col() once per TPS or pot step,
+    which has no limit but delays the next map by that much.
+    Reported with the rest of the stage 2 arithmetic (period_rpm(), ig_tbin,
+    ig_next_seg()) against the XC8 library divisions they replace.
+ 3. M command: M<i>=<v> rewrites the flash row of byte i only, answers
+    M<i>=<v> and the next pass interpolates ig_col[] from it. M<i> reads.
+    Refused while running and for a value over 255 (both answer the flash
+    value), a byte index out of range is ignored.
+ */
+
+#include "fw.h"
+
+#define ISR_SHARE           (16)    //1/16 revolution
+#define ACC_TOL             (0.1)   //deg
+#define ARITH_TOL           (0.05)  //deg. 1/256 segment position, floors, 1 count at 16000rpm
+
+static const uint8_t pot_set[] = {0, 128, 255};
+
+//Exact column value (0.1deg) of map ig_map_2d at rpm point i
+static double col_exact(uint8_t i, uint8_t t, uint8_t p) {
+    uint8_t k, m;
+    double v[2];
+
+    for (k = 0; (k < IG_TPS_SIZE - 2)&&(t > ig_tps_axis[k + 1]); k++);
+    for (m = 0; m < 2; m++) {
+        v[m] = ig_map_2d[m][k][i] + (double) (ig_map_2d[m][k + 1][i] - ig_map_2d[m][k][i])
+                * (t - ig_tps_axis[k]) / (ig_tps_axis[k + 1] - ig_tps_axis[k]);
+    }
+    return v[0] + (v[1] - v[0]) * p / 255.0;
+}
+
+static double deg_exact(uint16_t a, uint8_t t, uint8_t p) {
+    uint8_t i;
+
+    for (i = 0; (i < IG_RPM_SIZE - 2)&&(a > ig_rpm_axis[i + 1]); i++);
+    return (col_exact(i, t, p) + (col_exact(i + 1, t, p) - col_exact(i, t, p))
+            * (a - ig_rpm_axis[i]) / (ig_rpm_axis[i + 1] - ig_rpm_axis[i])) / 10.0;
+}
+
+static void run_accuracy(void *arg) {
+    double col_max, tab_max, ari_max, e, w, us_deg, d;
+    int16_t isr_col[IG_RPM_SIZE];
+    uint16_t a, a_max;
+    uint8_t i, p, sel;
+    int t;
+
+    (void) arg;
+    fw_boot();
+    col_max = tab_max = ari_max = 0;
+    a_max = 0;
+    for (p = 0; p < sizeof (pot_set); p++) {
+        for (t = 0; t < 256; t++) {
+            ig_map_tps = (uint8_t) t;
+            ig_map_pot = pot_set[p];
+            sel = ig_map_sel;
+            memcpy(isr_col, ig_col[sel], sizeof (isr_col));
+            ig_map_col();
+            CHECK((ig_map_sel == (sel ^ 1))&&(memcmp(isr_col, ig_col[sel], sizeof (isr_col)) == 0),
+                    "TPS %d: ig_col[] the ISR reads was written", t);
+            for (i = 0; i < IG_RPM_SIZE; i++) {
+                e = fabs(ig_col[ig_map_sel][i] / 100.0 - col_exact(i, (uint8_t) t, pot_set[p]) / 10.0);
+                if (e > col_max) col_max = e;
+            }
+            for (a = FIXED_IG_RPM; a <= MAX_MAP_RPM; a++) {
+                us_deg = a * RPM_BIN_WIDTH * 6e-6;
+                d = deg_exact(a, (uint8_t) t, pot_set[p]);
+                w = (param_pu1_deg / 100.0 - d) / us_deg - LAT_US(a);
+                e = fabs(ig_map_wait(a) / 8.0 - w) * us_deg;
+                if (e > tab_max) {
+                    tab_max = e;
+                    a_max = a;
+                }
+                //us = coeff x (pu1_deg - deg) (*100deg) / 2048
+                w = deg2time_coeff[a] * (param_pu1_deg - d * 100.0) / 2048.0 - LAT_US(a);
+                e = fabs(ig_map_wait(a) / 8.0 - w) * us_deg;
+                if (e > ari_max) ari_max = e;
+            }
+        }
+    }
+    printf("accuracy, TPS 0-255 x pot 0/128/255, %u bins each:\n", MAX_MAP_RPM - FIXED_IG_RPM + 1);
+    printf("  ig_col[] (TPS, pot)               worst %.3fdeg\n", col_max);
+    printf("  ig_map_wait() (rpm, waiting time) worst %.3fdeg at %urpm\n", tab_max, a_max * RPM_BIN_WIDTH);
+    printf("  ig_map_wait() by deg2time_coeff   worst %.3fdeg (fixed point arithmetic only)\n", ari_max);
+    CHECK(tab_max <= ACC_TOL, "ig_map_wait() %.3fdeg off the bilinear map", tab_max);
+    CHECK(ari_max <= ARITH_TOL, "ig_map_wait() arithmetic %.3fdeg off", ari_max);
+}
+
+static void run_wcet(void *arg) {
+    uint32_t cy, cy_max;
+    uint16_t a, a_max;
+    uint8_t i;
+    double rev;
+
+    (void) arg;
+    fw_boot();
+    cy_max = 0;
+    a_max = 0;
+    for (a = FIXED_IG_RPM; a <= MAX_MAP_RPM; a++) {
+        for (i = 0; (i < IG_RPM_SIZE - 2)&&(a > ig_rpm_axis[i + 1]); i++);
+        cy = CY_MAP_BIN + i * (uint32_t) CY_SEG;
+        if (cy > cy_max) {
+            cy_max = cy;
+            a_max = a;
+        }
+    }
+    rev = 60e6 / (MAX_MAP_RPM * RPM_BIN_WIDTH);
+    printf("WCET model (cycles of 125ns):\n");
+    printf("  ig_map_wait() in stage 2: worst %lu cy = %.0fus at %urpm, per revolution\n",
+            (unsigned long) cy_max, cy_max / CY_US, a_max * RPM_BIN_WIDTH);
+    printf("  period_rpm(): %d cy (24/24 __aldiv %d cy)\n", CY_PERIOD_RPM, CY_DIV24);
+    printf("  ig_tbin: %d cy (24/16 __aldiv)\n", CY_DIV24);
+    printf("  ig_next_seg(): %d cy (__lmul + 32/24 __aldiv %d cy)\n", CY_NEXT_SEG,
+            CY_NEXT_SEG - CY_DIVF16 - CY_MULH16X16 + CY_MUL32 + CY_DIV32);
+    printf("  stage 2 arithmetic: worst %lu cy = %.0fus (%lu cy before)\n",
+            (unsigned long) (cy_max + CY_PERIOD_RPM + CY_DIV24 + CY_NEXT_SEG),
+            (cy_max + CY_PERIOD_RPM + CY_DIV24 + CY_NEXT_SEG) / CY_US,
+            (unsigned long) (cy_max + 2 * CY_DIV24 + CY_NEXT_SEG - CY_DIVF16 - CY_MULH16X16 + CY_MUL32 + CY_DIV32));
+    printf("  ig_map_col() in the main loop: %d cy = %.0fus, per TPS or pot step\n", CY_COL, CY_COL / CY_US);
+    printf("  one revolution at %urpm: %.0fus\n", MAX_MAP_RPM * RPM_BIN_WIDTH, rev);
+    CHECK(cy_max / CY_US < rev / ISR_SHARE, "ig_map_wait() %.0fus over 1/%d revolution", cy_max / CY_US, ISR_SHARE);
+}
+
+static const char *tx_line(void) {
+    static char line[32];
+    int n;
+
+    n = sim_tx_n;
+    while ((n > 0)&&((sim_tx[n - 1] == '\r') || (sim_tx[n - 1] == '\n'))) n--;
+    while ((n > 0)&&(sim_tx[n - 1] != '\n')) n--;
+    snprintf(line, sizeof (line), "%s", &sim_tx[n]);
+    line[strcspn(line, "\r\n")] = 0;
+    return line;
+}
+
+static void cmd(const char *s) {
+    int k;
+
+    sim_tx_n = 0;
+    sim_tx[0] = 0;
+    sim_uart_rx(s);
+    for (k = 0; k < 64; k++) {
+        sim_run(sim_now() + 200);
+        fw_loop();
+    }
+}
+
+static void run_cmd(void *arg) {
+    uint8_t old[IG_MAP_BYTES], *m;
+    uint16_t t_old, t_new;
+    uint16_t a, b;
+    int k;
+
+    (void) arg;
+    fw_boot();
+    m = &ig_map_2d[0][0][0];
+    memcpy(old, m, IG_MAP_BYTES);
+    //Map 0, TPS 0 (tps stays 0), rpm point 5: 4000rpm
+    b = ig_rpm_axis[5];
+    for (k = 0; k < 16; k++) fw_loop();
+    t_old = ig_map_wait(b);
+    cmd("M5=150\r\n");
+    CHECK(strcmp(tx_line(), "M5=150") == 0, "M5=150 answered \"%s\"", tx_line());
+    CHECK(m[5] == 150, "flash byte 5 is %u", m[5]);
+    for (a = 0; a < IG_MAP_BYTES; a++) {
+        if (a != 5) CHECK(m[a] == old[a], "byte %u changed", a);
+    }
+    t_new = ig_map_wait(b);
+    CHECK(fabs(fw_map_deg(b) - 15.0) < 0.01, "map angle %.2fdeg at 4000rpm", fw_map_deg(b));
+    CHECK(t_new > t_old, "map not rebuilt (%u -> %u)", t_old, t_new);
+    cmd("M5\r\n");
+    CHECK(strcmp(tx_line(), "M5=150") == 0, "M5 answered \"%s\"", tx_line());
+    cmd("M255=7\r\n");
+    CHECK((strcmp(tx_line(), "M255=7") == 0)&&(m[255] == 7), "last byte: \"%s\"", tx_line());
+    cmd("M256=1\r\n");
+    CHECK(sim_tx_n == 0, "M256 answered \"%s\"", tx_line());
+    cmd("M5=256\r\n");
+    CHECK((strcmp(tx_line(), "M5=150") == 0)&&(m[5] == 150), "M5=256 answered \"%s\"", tx_line());
+    cmd("M5=1x\r\n");
+    CHECK((strcmp(tx_line(), "M5=150") == 0)&&(m[5] == 150), "M5=1x answered \"%s\"", tx_line());
+    printf("M command: write, read back, rebuild (%u -> %u at 4000rpm), range checks\n", t_old, t_new);
+
+    //Running: refused
+    fw_const_rpm = 3000;
+    sim_engine(fw_rpm_const, param.pu1_deg / 100.0);
+    sim_run(sim_now() + 100000);
+    cmd("M5=100\r\n");
+    CHECK((strcmp(tx_line(), "M5=150") == 0)&&(m[5] == 150), "running: M5=100 answered \"%s\"", tx_line());
+    printf("M command refused while running\n");
+}
+
+int main(void) {
+    fw_fork(run_accuracy, NULL);
+    fw_fork(run_wcet, NULL);
+    fw_fork(run_cmd, NULL);
+    printf("PASS\n");
+    return 0;
+}
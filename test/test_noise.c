@@ -0,0 +1,162 @@
+/*--------------------------------------------------------------------------
+ PU1 noise rejection test
+------------------------------------------------------------------------- */
+
+/*
+ Constant 6000rpm, PU1 filter on (PU1_FILTER_ENABLE).
+ 1. Noise bursts: on 40 revolutions, 1 to 6 extra PU1 edges 2-5us apart, at
+    a random phase in the blanking window (up to 45% of the period), also
+    on the spark and during the CCP2 gate. Every revolution must keep one
+    digital spark at the angle of a clean run, rpm must not move and no
+    edge may count as a resync. pu1_noise_cnt counts captures, so a burst
+    on the spark counts once (CCP1IF is set once while the ISR runs) and one
+    in the CCP2 gate not at all (ccp1_enable() after the gate clears
+    CCP1IF). Other edges count one each.
+ 2. Pickup dropout: one PU1 edge lost. The long period is counted once in
+    pu1_resync_cnt. Its revolution and the next one, whose rpm comes from
+    the long period, fire by PU2 only. From then on one digital spark per
+    revolution at the clean angle.
+ */
+
+#include "fw.h"
+
+#define RPM                 (6000.0)
+#define PERIOD              (60e6 / RPM)
+#define CLEAN_REVS          (20)
+#define NOISE_REVS          (40)
+#define ANGLE_TOL           (0.05)  //deg. A prescale change loses the ISR entry delay, 1us = 0.036deg
+
+static double pu1[256];
+static int pu1_n;
+
+static void pu1_collect(void) {
+    int a;
+
+    pu1_n = 0;
+    for (a = 0; (a < sim_pu_n)&&(pu1_n < 256); a++) {
+        if (sim_pu[a].kind == SIM_EDGE_PU1) pu1[pu1_n++] = sim_pu[a].t;
+    }
+}
+
+//Digital sparks in [t0, t1) and the angle of the last one
+static int digital_in(double t0, double t1, double *btdc) {
+    int a, n;
+
+    n = 0;
+    for (a = 0; a < sim_spark_n; a++) {
+        if ((sim_spark[a].kind != SIM_SPARK_PU2)&&(sim_spark[a].t >= t0)&&(sim_spark[a].t < t1)) {
+            n++;
+            *btdc = sim_btdc(sim_spark[a].t);
+        }
+    }
+    return n;
+}
+
+static int pu2_in(double t0, double t1) {
+    int a;
+
+    for (a = 0; a < sim_spark_n; a++) {
+        if ((sim_spark[a].kind == SIM_SPARK_PU2)&&(sim_spark[a].t >= t0)&&(sim_spark[a].t < t1)) return 1;
+    }
+    return 0;
+}
+
+static void boot_run(void) {
+    fw_boot();
+    fw_const_rpm = RPM;
+    sim_engine(fw_rpm_const, param.pu1_deg / 100.0);
+    sim_run(CLEAN_REVS * PERIOD);
+    pu1_collect();
+}
+
+static double clean_angle(void) {
+    double d = 0;
+
+    CHECK(digital_in(pu1[CLEAN_REVS - 3], pu1[CLEAN_REVS - 2], &d) == 1, "clean run: no spark");
+    return d;
+}
+
+static void burst(void *arg) {
+    double ref, d, t, spark_t;
+    int a, b, k, n, edges, min;
+    uint16_t rpm0;
+
+    (void) arg;
+    srand(30);
+    boot_run();
+    ref = clean_angle();
+    read_snapshot();
+    rpm0 = eg_view.rpm;
+    CHECK((eg_view.EG_state == EG_RUNNING)&&(eg_view.pu1_noise_cnt == 0), "clean run: state %u noise %u", eg_view.EG_state, eg_view.pu1_noise_cnt);
+    spark_t = (param.pu1_deg / 100.0 - ref) / (RPM * 6e-6);
+    edges = 0;
+    min = 0;
+    for (a = 0; a < NOISE_REVS; a++) {
+        t = pu1[CLEAN_REVS - 1] + (a + 1) * PERIOD;
+        switch (a % 4) {
+        case 0: //On the spark
+            t += spark_t;
+            break;
+        case 1: //In the CCP2 gate
+            t += spark_t + 20;
+            break;
+        default:
+            t += PERIOD * (0.02 + 0.43 * rand() / RAND_MAX);
+            break;
+        }
+        n = 1 + rand() % 6;
+        for (b = 0; b < n; b++) {
+            sim_edge(t, SIM_EDGE_PU1);
+            t += 2 + rand() % 4;
+        }
+        edges += n;
+        min += (a % 4 == 0) ? 1 : (a % 4 == 1) ? 0 : n;
+    }
+    sim_run(pu1[CLEAN_REVS - 1] + (NOISE_REVS + 1.5) * PERIOD);
+    pu1_collect();
+    for (k = CLEAN_REVS - 1; k < CLEAN_REVS + NOISE_REVS; k++) {
+        CHECK(digital_in(pu1[k], pu1[k + 1], &d) == 1, "rev %d: %d digital sparks", k, digital_in(pu1[k], pu1[k + 1], &d));
+        CHECK(fabs(d - ref) <= ANGLE_TOL, "rev %d: spark %.3fdeg, clean %.3fdeg", k, d, ref);
+    }
+    read_snapshot();
+    printf("noise bursts: %d edges on %d revolutions, %u counted, %u resync, rpm %u -> %u, spark %.3fdeg\n",
+            edges, NOISE_REVS, eg_view.pu1_noise_cnt, eg_view.pu1_resync_cnt, rpm0, eg_view.rpm, ref);
+    CHECK((eg_view.pu1_noise_cnt >= min)&&(eg_view.pu1_noise_cnt <= edges), "%u noise captures counted, %d-%d expected", eg_view.pu1_noise_cnt, min, edges);
+    CHECK(eg_view.pu1_resync_cnt == 0, "%u resync", eg_view.pu1_resync_cnt);
+    CHECK((eg_view.rpm == rpm0)&&(eg_view.EG_state == EG_RUNNING), "rpm %u state %u", eg_view.rpm, eg_view.EG_state);
+}
+
+static void dropout(void *arg) {
+    double ref, d, lost;
+    int k, n;
+
+    (void) arg;
+    boot_run();
+    ref = clean_angle();
+    lost = pu1[CLEAN_REVS - 1] + PERIOD;
+    sim_mask(SIM_EDGE_PU1, lost - 10, lost + 10);
+    sim_run(pu1[CLEAN_REVS - 1] + 11.5 * PERIOD);
+    pu1_collect();
+    //Engine edges after the lost one are shifted by one
+    CHECK(fabs(pu1[CLEAN_REVS] - lost) < 1, "lost edge not in the engine trace");
+    for (k = CLEAN_REVS + 1; k < CLEAN_REVS + 3; k++) {
+        n = digital_in(pu1[k], pu1[k + 1], &d);
+        CHECK(n == 0, "rev %d after dropout: %d digital sparks", k - CLEAN_REVS, n);
+        CHECK(pu2_in(pu1[k], pu1[k + 1]), "rev %d after dropout: no PU2 spark", k - CLEAN_REVS);
+    }
+    for (k = CLEAN_REVS + 3; k < CLEAN_REVS + 10; k++) {
+        CHECK(digital_in(pu1[k], pu1[k + 1], &d) == 1, "rev %d after dropout: %d digital sparks", k - CLEAN_REVS, digital_in(pu1[k], pu1[k + 1], &d));
+        CHECK(fabs(d - ref) <= ANGLE_TOL, "rev %d after dropout: spark %.3fdeg, clean %.3fdeg", k - CLEAN_REVS, d, ref);
+    }
+    read_snapshot();
+    printf("dropout: %u resync, PU2 ignition for 2 revolutions, then digital at %.3fdeg\n", eg_view.pu1_resync_cnt, d);
+    CHECK(eg_view.pu1_resync_cnt == 1, "%u resync", eg_view.pu1_resync_cnt);
+    CHECK(eg_view.EG_state == EG_RUNNING, "state %u", eg_view.EG_state);
+}
+
+int main(void) {
+    fw_fork(burst, NULL);
+    fw_fork(dropout, NULL);
+    printf("PASS\n");
+    return 0;
+}
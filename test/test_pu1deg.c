@@ -0,0 +1,93 @@
+/*--------------------------------------------------------------------------
+ Runtime PU1 angle test
+------------------------------------------------------------------------- */
+
+/*
+ pu1_deg is set over UART (P5) after boot and the engine runs with PU1 at
+ that angle, at constant rpm in the middle of a bin. param_update() hands
+ it to the waiting times of stage 2 and derives the PU1-PU2 segment
+ multiplier from it.
+   - ig_seg of the last PU2 edge must be the period the PU1 capture measured
+     (segment x 360 / (pu1_deg - PU2_deg)), within two counts of the PU2
+     timestamp (ISR entry) scaled to the period
+   - every digital spark after SKIP revolutions at the map angle of the bin
+     plus the LAT_US() the waiting time is shortened by
+ */
+
+#include "fw.h"
+
+#define REVS                (40)
+#define SKIP                (8)
+#define ANGLE_TOL           (0.1)   //deg
+
+static const uint16_t deg_set[] = {3000, 3200, 3500, 3750, 4000};
+static const double rpm_set[] = {3025, 6025, 10025, 14025};
+
+static void cmd(const char *s) {
+    int k;
+
+    sim_uart_rx(s);
+    for (k = 0; k < 64; k++) {
+        sim_run(sim_now() + 200);
+        fw_loop();
+    }
+}
+
+static void run(void *arg) {
+    char line[16];
+    double r, p, t0, t, d, target, max;
+    long diff;
+    int a, e, n, dig;
+    uint16_t deg, b;
+
+    deg = deg_set[*(int *) arg / 4];
+    r = rpm_set[*(int *) arg % 4];
+    p = 60e6 / r;
+    fw_boot();
+    sim_pin('A', 4, 0); //Main rev limitter off
+    check_sw_state();
+    snprintf(line, sizeof (line), "P5=%u\r\n", deg);
+    cmd(line);
+    CHECK(param_pu1_deg == deg, "pu1_deg %u", param_pu1_deg);
+    fw_const_rpm = r;
+    t0 = sim_now();
+    sim_engine(fw_rpm_const, deg / 100.0);
+    sim_run(t0 + REVS * p);
+    read_snapshot();
+    b = (uint16_t) (r / RPM_BIN_WIDTH);
+    CHECK((eg_view.EG_state == EG_RUNNING)&&(eg_view.rpm == b), "%u %.0frpm: state %u bin %u", deg, r, eg_view.EG_state, eg_view.rpm);
+    diff = (long) ig_seg - t1_count;
+    CHECK(labs(diff) <= 2 * 36000.0 / (deg - PU2_deg) + 1, "%u %.0frpm: ig_seg %lu, period %u", deg, r, (unsigned long) ig_seg, t1_count);
+
+    target = fw_map_deg(b) + LAT_US(b) * r * 6e-6;
+    max = 0;
+    for (n = 0, a = 0; a < sim_pu_n; a++) {
+        if (sim_pu[a].kind != SIM_EDGE_PU1) continue;
+        if (++n <= SKIP) continue;
+        if (sim_pu[a].t + p > t0 + REVS * p) break;
+        dig = 0;
+        t = 0;
+        for (e = 0; e < sim_spark_n; e++) {
+            if ((sim_spark[e].t < sim_pu[a].t) || (sim_spark[e].t >= sim_pu[a].t + p)) continue;
+            if (sim_spark[e].kind == SIM_SPARK_PU2) continue;
+            dig++;
+            t = sim_spark[e].t;
+        }
+        CHECK(dig == 1, "%u %.0frpm rev %d: %d digital sparks", deg, r, n, dig);
+        d = fabs(sim_btdc(t) - target);
+        if (d > max) max = d;
+    }
+    printf("pu1 %5.2fdeg %5.0frpm: ig_seg %6lu period %6u, spark max error %.3fdeg\n",
+            deg / 100.0, r, (unsigned long) ig_seg, t1_count, max);
+    CHECK(max <= ANGLE_TOL, "%u %.0frpm: spark %.3fdeg off the map", deg, r, max);
+}
+
+int main(void) {
+    int a;
+
+    for (a = 0; a < (int) (sizeof (deg_set) / sizeof (deg_set[0]) * 4); a++) {
+        fw_fork(run, &a);
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*--------------------------------------------------------------------------
+ Quick shifter cut latency benchmark
+------------------------------------------------------------------------- */
+
+/*
+ Built with QS_ENABLE 1. Constant 8000rpm, SW4 pin 2 open (QS_IN pulled
+ up). Shift edges come at TRIALS phases spread over one revolution, each
+ TRIAL_REVS revolutions after the last, with a second (bouncing) edge 100ms
+ after each, inside the lockout. The digital spark times of a clean run are the reference.
+ Per edge:
+   - latency: edge to the first reference spark that did not happen. Every
+     reference spark later than the ISR entry after the edge must be cut,
+     so it is bounded by one revolution plus the ISR entry.
+   - cut length: the sparks missing in a row, no PU2 analog spark either, qs_kill_table at 8000rpm plus
+     the spark cancelled in the revolution of the edge. The bouncing edge
+     must not add any.
+ Reported: minimum, mean and maximum latency and the cut lengths.
+ */
+
+#define QS_ENABLE           (1)
+#include "fw.h"
+
+#define RPM                 (8000.0)
+#define PERIOD              (60e6 / RPM)
+#define TRIALS              (32)
+#define TRIAL_REVS          (48)    //Over the 250ms lockout (34 revolutions)
+#define CLEAN_REVS          (20)
+#define MATCH_TOL           (2.0)   //us
+
+static double spark_t[4096];
+static int spark_n;
+
+static void sparks_collect(double t0) {
+    int a;
+
+    spark_n = 0;
+    for (a = 0; (a < sim_spark_n)&&(spark_n < 4096); a++) {
+        if ((sim_spark[a].kind != SIM_SPARK_PU2)&&(sim_spark[a].t >= t0)) spark_t[spark_n++] = sim_spark[a].t;
+    }
+}
+
+static int spark_at(double t) {
+    int a;
+
+    for (a = 0; a < spark_n; a++) {
+        if (fabs(spark_t[a] - t) < MATCH_TOL) return 1;
+    }
+    return 0;
+}
+
+static void run(void *arg) {
+    double ref0, t0, edge, t, lat, lat_min, lat_max, lat_sum;
+    double first;
+    int a, k, cut, kill, cut_min, cut_max;
+    uint16_t b;
+
+    (void) arg;
+    fw_boot();
+    fw_const_rpm = RPM;
+    sim_engine(fw_rpm_const, param.pu1_deg / 100.0);
+    sim_run(CLEAN_REVS * PERIOD);
+    sparks_collect((CLEAN_REVS - 2) * PERIOD);
+    CHECK(spark_n >= 1, "clean run: no spark");
+    ref0 = spark_t[spark_n - 1]; //Reference spark k is at ref0 + k x PERIOD
+    read_snapshot();
+    b = eg_view.rpm;
+    kill = qs_kill_table[(b - QS_MIN_RPM) / QS_STEP];
+    t0 = ref0 + PERIOD / 2;
+    for (a = 0; a < TRIALS; a++) {
+        edge = t0 + (a * TRIAL_REVS + (a + 0.5) / TRIALS) * PERIOD;
+        sim_edge(edge, SIM_EDGE_QS);
+        sim_edge(edge + 100000, SIM_EDGE_QS);
+    }
+    sim_run(t0 + (TRIALS * TRIAL_REVS + 2) * PERIOD);
+    sparks_collect(t0);
+
+    lat_min = 1e9;
+    lat_max = lat_sum = 0;
+    cut_min = 1000;
+    cut_max = 0;
+    for (a = 0; a < TRIALS; a++) {
+        edge = t0 + (a * TRIAL_REVS + (a + 0.5) / TRIALS) * PERIOD;
+        //First reference spark after the edge
+        k = (int) ceil((edge - ref0) / PERIOD);
+        t = ref0 + k * PERIOD;
+        if ((t - edge < SIM_ISR_ENTRY / (double) SIM_TICK_US)&&(spark_at(t))) t += PERIOD; //Fired before the ISR
+        CHECK(!spark_at(t), "edge %d (phase %.3f): spark %.1fus after the edge not cut", a, (a + 0.5) / TRIALS, t - edge);
+        first = t;
+        for (cut = 0; (cut < TRIAL_REVS - 2)&&(!spark_at(t)); cut++) t += PERIOD;
+        CHECK(spark_at(t), "edge %d: no spark after the cut", a);
+        for (k = 0; k < sim_spark_n; k++) {
+            CHECK((sim_spark[k].t < first - MATCH_TOL) || (sim_spark[k].t > t - PERIOD + MATCH_TOL), "edge %d: spark (kind %d) in the cut", a, sim_spark[k].kind);
+        }
+        lat = first - edge;
+        if (lat < lat_min) lat_min = lat;
+        if (lat > lat_max) lat_max = lat;
+        lat_sum += lat;
+        if (cut < cut_min) cut_min = cut;
+        if (cut > cut_max) cut_max = cut;
+        CHECK((cut == kill) || (cut == kill + 1), "edge %d: %d sparks cut, kill time %d revolutions", a, cut, kill);
+    }
+    printf("%.0frpm, %d shift edges over one revolution (%.0fus)\n", RPM, TRIALS, PERIOD);
+    printf("edge to first suppressed spark: min %.1fus  mean %.1fus  max %.1fus (bound %.1fus)\n",
+            lat_min, lat_sum / TRIALS, lat_max, PERIOD + SIM_ISR_ENTRY / (double) SIM_TICK_US);
+    printf("sparks cut: %d-%d (kill table %d revolutions + armed spark cancelled)\n", cut_min, cut_max, kill);
+    CHECK(lat_max <= PERIOD + SIM_ISR_ENTRY / (double) SIM_TICK_US, "latency over one revolution");
+}
+
+int main(void) {
+    fw_fork(run, NULL);
+    printf("PASS\n");
+    return 0;
+}
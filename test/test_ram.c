@@ -0,0 +1,55 @@
+/*--------------------------------------------------------------------------
+ RAM budget test
+------------------------------------------------------------------------- */
+
+/*
+ XC8 is not run here, so the data memory of the firmware is bounded on the
+ host: main.c alone is compiled to an object (fw_ram, flash tables stay
+ const) and the sizes of the RAM symbols nm lists are summed. Host sizes
+ are at least the XC8 ones (uint24_t 4 bytes, int and pointers wider, more
+ padding). The sum must leave RAM_STACK of the 1024 bytes to the XC8
+ compiled stack (autos and parameters) and the runtime. The baseline build
+ (memoryfile.xml, 967 bytes) used about 140 bytes over its globals.
+ Reported: the total and the largest symbols.
+ */
+
+#include "fw.h"
+
+#define RAM_SIZE            (1024)
+#define RAM_STACK           (256)
+#define TOP                 (6)
+
+int main(void) {
+    char line[256], name[128], type;
+    char top_name[TOP][128];
+    unsigned long addr, size, total, top_size[TOP];
+    int a, k, n;
+    FILE *f;
+
+    f = popen(NM " -S " FW_RAM_OBJ, "r");
+    CHECK(f != NULL, "%s", NM);
+    total = 0;
+    n = 0;
+    memset(top_size, 0, sizeof (top_size));
+    while (fgets(line, sizeof (line), f)) {
+        if (sscanf(line, "%lx %lx %c %127s", &addr, &size, &type, name) != 4) continue;
+        if (!strchr("bBdDcC", type)) continue;
+        total += size;
+        n++;
+        for (a = 0; (a < TOP)&&(size <= top_size[a]); a++);
+        if (a == TOP) continue;
+        for (k = TOP - 1; k > a; k--) {
+            top_size[k] = top_size[k - 1];
+            strcpy(top_name[k], top_name[k - 1]);
+        }
+        top_size[a] = size;
+        strcpy(top_name[a], name);
+    }
+    pclose(f);
+    CHECK(n > 0, "no RAM symbols in %s", FW_RAM_OBJ);
+    printf("RAM of %d symbols: %lu bytes (host sizes), budget %d = %d - %d stack\n", n, total, RAM_SIZE - RAM_STACK, RAM_SIZE, RAM_STACK);
+    for (a = 0; (a < TOP)&&(top_size[a] != 0); a++) printf("  %4lu %s\n", top_size[a], top_name[a]);
+    CHECK(total <= RAM_SIZE - RAM_STACK, "RAM %lu bytes over %d", total, RAM_SIZE - RAM_STACK);
+    printf("PASS\n");
+    return 0;
+}
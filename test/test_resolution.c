@@ -0,0 +1,107 @@
+/*--------------------------------------------------------------------------
+ Spark angle resolution benchmark, adaptive TMR1 prescale against 1:8
+------------------------------------------------------------------------- */
+
+/*
+ The engine runs at constant rpm from 3000 to 16000rpm in 37rpm steps,
+ moved to the middle of their bin,
+ once with the adaptive prescale and once held at stage 0 (1:8, 1us), the
+ fixed prescale before. The digital spark of every revolution after the
+ prescale has settled is compared with the map angle of the rpm bin plus
+ the LAT_US() the waiting time is shortened by.
+ Reported per rpm band: degrees per TMR1 count and the worst spark angle
+ error of both, and the part of it that is already in the map (angle step,
+ deg2time_coeff rounding), which no prescale can take out.
+ The worst error of the adaptive prescale must be lower in every band from
+ 4000rpm, where it leaves 1:8. Single rpm may be luckier at 1:8, as
+ truncation can cancel the table error.
+ */
+
+#include <sys/mman.h>
+#include "fw.h"
+
+#define R_MIN               (3000)
+#define R_MAX               (16000)
+#define R_STEP              (37)
+#define R_N                 ((R_MAX - R_MIN) / R_STEP + 1)
+#define REVS                (40)
+#define SETTLE              (8)     //Revolutions until stage 2
+
+typedef struct {
+    double err[2];          //Worst spark angle error: 0 adaptive, 1 fixed 1:8
+    double table;           //ig_map_wait() error (deg)
+} RESULT;
+
+static RESULT *res;
+
+//Mid of a bin. At a bin edge one period count flips the bin and its angle
+static double r_of(int a) {
+    return RPM_BIN_WIDTH * floor((R_MIN + a * R_STEP) / RPM_BIN_WIDTH) + RPM_BIN_WIDTH / 2;
+}
+
+static void run(void *arg) {
+    int k = *(int *) arg;
+    int fixed = k & 1;
+    double r, target, ideal, e, max;
+    double pu1[REVS + 2];
+    uint16_t b;
+    int a, n;
+
+    r = r_of(k >> 1);
+    if (fixed) t1_ps_up_rpm[0] = 0xFFFF;
+    fw_boot();
+    sim_pin('A', 4, 0); //Main rev limitter off
+    check_sw_state();
+    fw_const_rpm = r;
+    sim_engine(fw_rpm_const, param.pu1_deg / 100.0);
+    sim_run((REVS + 0.5) * 60e6 / r);
+    b = (uint16_t) (r / RPM_BIN_WIDTH);
+    target = fw_map_deg(b) + LAT_US(b) * r * 6e-6;
+    n = 0;
+    for (a = 0; (a < sim_pu_n)&&(n < REVS + 2); a++) {
+        if (sim_pu[a].kind == SIM_EDGE_PU1) pu1[n++] = sim_pu[a].t;
+    }
+    max = 0;
+    for (a = 0; a < sim_spark_n; a++) {
+        if ((sim_spark[a].kind == SIM_SPARK_PU2) || (sim_spark[a].t < pu1[SETTLE])) continue;
+        e = fabs(sim_btdc(sim_spark[a].t) - target);
+        if (e > max) max = e;
+    }
+    CHECK(max < 1.0, "%.0frpm %s: spark %.2fdeg off the map", r, fixed ? "1:8" : "adaptive", max);
+    res[k >> 1].err[fixed] = max;
+    //Waiting time of the map against the exact one, as angle
+    ideal = (param_pu1_deg / 100.0 - fw_map_deg(b)) / (b * RPM_BIN_WIDTH * 6e-6) - LAT_US(b);
+    res[k >> 1].table = fabs(ig_map_wait(b) / 8.0 - ideal) * b * RPM_BIN_WIDTH * 6e-6;
+}
+
+static double deg_per_count(double r, uint8_t s) {
+    return r * 6e-6 / (1 << t1_ps_shift[s]);
+}
+
+int main(void) {
+    uint16_t band[] = {3000, 4000, 6000, 8000, 10000, 12000, 14000, 16001};
+    double e[3], r;
+    int a, b, k;
+
+    res = mmap(NULL, R_N * sizeof (RESULT), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(res != MAP_FAILED, "mmap");
+    for (k = 0; k < 2 * R_N; k++) fw_fork(run, &k);
+
+    printf("rpm          deg/count 1:8  adaptive  | worst error 1:8  adaptive  in map\n");
+    for (b = 0; b < (int) (sizeof (band) / sizeof (band[0])) - 1; b++) {
+        e[0] = e[1] = e[2] = 0;
+        for (a = 0; a < R_N; a++) {
+            r = r_of(a);
+            if ((r < band[b]) || (r >= band[b + 1])) continue;
+            if (res[a].err[1] > e[0]) e[0] = res[a].err[1];
+            if (res[a].err[0] > e[1]) e[1] = res[a].err[0];
+            if (res[a].table > e[2]) e[2] = res[a].table;
+        }
+        r = (band[b + 1] > R_MAX) ? R_MAX : band[b + 1];
+        printf("%5u-%5.0f      %.3f     %.3f   |        %.3f     %.3f       %.3f\n",
+                band[b], r, deg_per_count(r, 0), deg_per_count(r, (r > 8000) ? 2 : (r > 4000) ? 1 : 0), e[0], e[1], e[2]);
+        if (band[b] >= 4000) CHECK(e[1] < e[0], "%u-%.0frpm: adaptive not better", band[b], r);
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*--------------------------------------------------------------------------
+ Rev limitter trace test
+------------------------------------------------------------------------- */
+
+/*
+ Main limitter (REV_SEL open, default 9500-9900rpm). The engine is held
+ at one rpm in each table step and above H, REVS revolutions each, and
+ every revolution is traced as spark or cut.
+   - cuts per step: REVS x revlimit_cut_table / REVLIMIT_CUT_FULL, +-1
+   - spread: runs of cuts and of sparks no longer than the ratio allows
+   - retard: digital spark at the map angle less revlimit_ret_table
+   - at and over H no spark at all, below L no cut and no retard
+ The first revolutions after each rpm change are not counted.
+ */
+
+#include "fw.h"
+
+#define REVS                (128)
+#define SKIP                (3)
+#define ANGLE_TOL           (0.05)  //deg
+
+static const double step_rpm[] = {9450, 9550, 9650, 9750, 9850, 9950};
+#define STEPS               (sizeof (step_rpm) / sizeof (step_rpm[0]))
+
+static double step_t[STEPS + 1];    //Start of each step (us)
+
+static double steps_rpm(double t_us, double deg) {
+    unsigned a;
+
+    (void) deg;
+    for (a = 0; (a < STEPS - 1)&&(t_us >= step_t[a + 1]); a++);
+    return step_rpm[a];
+}
+
+static void run(void *arg) {
+    static double pu1[STEPS * REVS + 16];
+    static char trace[REVS + 1];
+    double r, d, target, ret, t;
+    int a, k, n, s, cuts, runc, runs, maxc, maxs, cut, exp_cut;
+    int ig, dig, e;
+    uint16_t b, i;
+
+    (void) arg;
+    fw_boot();
+    sim_engine(steps_rpm, param.pu1_deg / 100.0);
+    sim_run(step_t[STEPS]);
+    n = 0;
+    for (a = 0; (a < sim_pu_n)&&(n < (int) (sizeof (pu1) / sizeof (pu1[0]))); a++) {
+        if (sim_pu[a].kind == SIM_EDGE_PU1) pu1[n++] = sim_pu[a].t;
+    }
+    printf("rpm    cut/128  cuts  expected  longest run cut/spark  retard  trace (| spark, . cut)\n");
+    k = 0;
+    for (s = 0; s < (int) STEPS; s++) {
+        r = step_rpm[s];
+        b = (uint16_t) (r / RPM_BIN_WIDTH);
+        i = (b >= revlimit_l_bin[REVLIMIT_MAIN]) ? (b - revlimit_l_bin[REVLIMIT_MAIN]) / REVLIMIT_STEP : 0;
+        if (b < revlimit_l_bin[REVLIMIT_MAIN]) {
+            exp_cut = 0;
+            ret = 0;
+        } else if (b >= revlimit_h_bin[REVLIMIT_MAIN]) {
+            exp_cut = REVLIMIT_CUT_FULL;
+            ret = 0;
+        } else {
+            exp_cut = revlimit_cut_table[REVLIMIT_MAIN][i];
+            ret = revlimit_ret_table[REVLIMIT_MAIN][i] / 8.0 * r * 6e-6;
+        }
+        target = fw_map_deg(b) + LAT_US(b) * r * 6e-6 - ret;
+        while ((k < n)&&(pu1[k] < step_t[s])) k++;
+        k += SKIP;
+        cuts = runc = runs = maxc = maxs = 0;
+        for (a = 0; a < REVS - 2 * SKIP; a++, k++) {
+            CHECK(k + 1 < n, "%.0frpm: trace ends", r);
+            ig = dig = 0;
+            for (t = 0, e = 0; e < sim_spark_n; e++) {
+                if ((sim_spark[e].t < pu1[k]) || (sim_spark[e].t >= pu1[k + 1])) continue;
+                ig++;
+                if (sim_spark[e].kind != SIM_SPARK_PU2) {
+                    dig++;
+                    t = sim_spark[e].t;
+                }
+            }
+            cut = (ig == 0);
+            trace[a] = cut ? '.' : '|';
+            if (cut) {
+                cuts++;
+                runs = 0;
+                if (++runc > maxc) maxc = runc;
+            } else {
+                runc = 0;
+                if (++runs > maxs) maxs = runs;
+                CHECK(dig == 1, "%.0frpm rev %d: %d digital sparks", r, a, dig);
+                d = sim_btdc(t);
+                CHECK(fabs(d - target) <= ANGLE_TOL, "%.0frpm rev %d: spark %.3fdeg, map - retard %.3fdeg", r, a, d, target);
+            }
+        }
+        trace[a < 48 ? a : 48] = 0;
+        printf("%5.0f  %3d      %3d   %6.1f    %3d / %-3d              %.2f    %s\n",
+                r, exp_cut, cuts, (double) a * exp_cut / REVLIMIT_CUT_FULL, maxc, maxs, ret, trace);
+        CHECK(fabs(cuts - (double) a * exp_cut / REVLIMIT_CUT_FULL) <= 1.0, "%.0frpm: %d cuts in %d", r, cuts, a);
+        if ((exp_cut > 0)&&(exp_cut < REVLIMIT_CUT_FULL)) {
+            CHECK(maxc <= (exp_cut + (REVLIMIT_CUT_FULL - exp_cut) - 1) / (REVLIMIT_CUT_FULL - exp_cut), "%.0frpm: %d cuts in a row", r, maxc);
+            CHECK(maxs <= (REVLIMIT_CUT_FULL - exp_cut + exp_cut - 1) / exp_cut, "%.0frpm: %d sparks in a row", r, maxs);
+        }
+    }
+}
+
+int main(void) {
+    unsigned a;
+
+    step_t[0] = 0;
+    for (a = 0; a < STEPS; a++) step_t[a + 1] = step_t[a] + REVS * 60e6 / step_rpm[a];
+    fw_fork(run, NULL);
+    printf("PASS\n");
+    return 0;
+}
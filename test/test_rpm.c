@@ -0,0 +1,74 @@
+/*--------------------------------------------------------------------------
+ Period to rpm test
+------------------------------------------------------------------------- */
+
+/*
+ 1. period_rpm() against the true rpm from 1500 to 16000rpm in 1rpm steps,
+    with the period counted at the prescale stage the engine runs at.
+    The bin must be the floor of the true rpm, give or take one count of
+    the period, and every bin must be reached.
+ 2. The simulated engine at constant rpm near the top of the map: rpm of
+    the snapshot must be the bin of the engine speed.
+ */
+
+#include "fw.h"
+
+#if (RPM_NUM(3) > 0xFFFFFF) || ((EG_STOP_OVF << 3) * 65536UL > 0xFFFFFF)
+#error "rpm division does not fit 24bit"
+#endif
+
+static void run(void *arg) {
+    double r = *(double *) arg;
+
+    fw_boot();
+    sim_pin('A', 4, 0); //Main rev limitter off
+    check_sw_state();
+    fw_const_rpm = r;
+    sim_engine(fw_rpm_const, param.pu1_deg / 100.0);
+    sim_run(400000);
+    read_snapshot();
+    printf("engine %5.0frpm: rpm bin %u (%urpm) stage %u\n", r, eg_view.rpm, eg_view.rpm * RPM_BIN_WIDTH, t1_ps);
+    CHECK(eg_view.rpm == (uint16_t) (r / RPM_BIN_WIDTH), "expected bin %u", (uint16_t) (r / RPM_BIN_WIDTH));
+    CHECK(eg_view.EG_state == EG_RUNNING, "state %u", eg_view.EG_state);
+}
+
+static uint8_t stage_of(double r) {
+    if (r >= 8000) return 2;
+    if (r >= 4000) return 1;
+    return 0;
+}
+
+int main(void) {
+    static uint8_t seen[MAP_SIZE + 1];
+    double r, cnt, lo, hi;
+    uint8_t s;
+    uint16_t bin, a, missing;
+    double test_rpm[] = {12025, 12490, 12510, 13075, 14980, 15975};
+
+    for (r = 1500; r <= 16000; r += 1.0) {
+        s = stage_of(r);
+        cnt = 60e6 / r * (1 << t1_ps_shift[s]);
+        bin = period_rpm((uint24_t) cnt, s);
+        //True rpm of the truncated period and of one count more
+        hi = 60e6 / (floor(cnt) / (1 << t1_ps_shift[s]));
+        lo = 60e6 / ((floor(cnt) + 1) / (1 << t1_ps_shift[s]));
+        CHECK((bin * RPM_BIN_WIDTH <= hi)&&(bin * RPM_BIN_WIDTH > lo - RPM_BIN_WIDTH),
+                "%.0frpm: bin %u (%urpm), period %.0f counts at stage %u", r, bin, bin * RPM_BIN_WIDTH, cnt, s);
+        seen[bin] = 1;
+    }
+    missing = 0;
+    for (a = FIXED_IG_RPM; a <= MAX_MAP_RPM; a++) {
+        if (!seen[a]) {
+            printf("bin %u (%urpm) never reached\n", a, a * RPM_BIN_WIDTH);
+            missing++;
+        }
+    }
+    CHECK(missing == 0, "%u bins skipped", missing);
+    printf("1500-16000rpm: every bin reached, none off by more than one period count\n");
+
+    for (a = 0; a < sizeof (test_rpm) / sizeof (test_rpm[0]); a++) {
+        fw_fork(run, &test_rpm[a]);
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*--------------------------------------------------------------------------
+ Engine snapshot seqlock stress test
+------------------------------------------------------------------------- */
+
+/*
+ The ISR (publish_snapshot) can only interrupt the main loop
+ (read_snapshot), never the other way round. Both are run on one thread
+ and the "interrupt" is a signal handler:
+   1. Every interleaving (x86-64 Linux): read_snapshot() is single stepped
+      with the trap flag and the ISR publishes once after instruction k,
+      for every k of the copy. The copy must be whole, old or new.
+      The same on a copy without the retry must tear, or the test proves
+      nothing.
+   2. Random: a 20us interval timer publishes while the main loop copies
+      for 1s.
+ Every field of a publish is derived from one generation number.
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include "fw.h"
+
+static volatile uint16_t gen;
+static volatile long step, inject_at;
+static volatile int stepping;
+
+static void publish(uint16_t k) {
+    rpm = k;
+    EG_state = k % 5;
+    ig_counter = k * 3;
+    t1_count = ~k;
+    t1_ovf_cap = (uint8_t) k;
+    t1_ps = k % T1_PS_STAGES;
+    pu1_noise_cnt = k ^ 0x5555;
+    pu1_resync_cnt = k + 7;
+    eg_trans_cnt = k * 5;
+    publish_snapshot();
+}
+
+//Generation of a whole copy, -1 if torn
+static long view_gen(const ENGINE_SNAPSHOT *v) {
+    uint16_t k = v->rpm;
+    uint16_t nk = ~k;
+
+    if ((v->EG_state != k % 5) || (v->ig_counter != (uint16_t) (k * 3)) || (v->t1_count != nk)
+            || (v->t1_ovf != (uint8_t) k) || (v->t1_ps != k % T1_PS_STAGES) || (v->pu1_noise_cnt != (k ^ 0x5555))
+            || (v->pu1_resync_cnt != (uint16_t) (k + 7))
+            || (v->eg_trans_cnt != (uint16_t) (k * 5))) return -1;
+    return k;
+}
+
+//read_snapshot() without the retry (negative control)
+static void read_once(void) {
+    eg_view.rpm = eg_snap.rpm;
+    eg_view.EG_state = eg_snap.EG_state;
+    eg_view.ig_counter = eg_snap.ig_counter;
+    eg_view.t1_count = eg_snap.t1_count;
+    eg_view.t1_ovf = eg_snap.t1_ovf;
+    eg_view.t1_ps = eg_snap.t1_ps;
+    eg_view.pu1_noise_cnt = eg_snap.pu1_noise_cnt;
+    eg_view.pu1_resync_cnt = eg_snap.pu1_resync_cnt;
+    eg_view.eg_trans_cnt = eg_snap.eg_trans_cnt;
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+static void on_trap(int sig, siginfo_t *si, void *ctx) {
+    ucontext_t *uc = ctx;
+
+    (void) sig;
+    (void) si;
+    if (!stepping) {
+        uc->uc_mcontext.gregs[REG_EFL] &= ~0x100L;
+        return;
+    }
+    if (++step == inject_at) publish(++gen);
+}
+
+static void __attribute__((noinline)) stepped(void (*copy)(void)) {
+    stepping = 1;
+    __asm__ volatile("pushfq\n\torq $0x100, (%%rsp)\n\tpopfq" ::: "memory", "cc");
+    copy();
+    stepping = 0;
+}
+
+//Returns interleavings tried. torn/new: copies that were torn or took the new publish
+static long interleave(void (*copy)(void), long *torn, long *fresh) {
+    long k, total;
+    long g;
+
+    *torn = 0;
+    *fresh = 0;
+    step = 0;
+    inject_at = -1;
+    stepped(copy);
+    total = step;
+    for (k = 1; k <= total; k++) {
+        publish(++gen);
+        step = 0;
+        inject_at = k;
+        stepped(copy);
+        g = view_gen(&eg_view);
+        if (g < 0) (*torn)++;
+        else if (g == gen) (*fresh)++;
+        else if (g != (uint16_t) (gen - 1)) FAIL("copy of generation %ld, expected %u or %u", g, gen - 1, gen);
+    }
+    return total;
+}
+#endif
+
+static void on_alarm(int sig) {
+    (void) sig;
+    publish(++gen);
+}
+
+int main(void) {
+    struct itimerval it;
+    struct timeval t0, t1;
+    long reads, torn, fresh, n;
+
+#if defined(__x86_64__) && defined(__linux__)
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_sigaction = on_trap;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGTRAP, &sa, NULL);
+    n = interleave(read_once, &torn, &fresh);
+    printf("no retry:   %ld interleavings, %ld torn\n", n, torn);
+    if (n == 0) {
+        printf("single step not available, random test only\n");
+    } else {
+        CHECK(torn > 0, "negative control never tore, injection does not reach the copy");
+        n = interleave(read_snapshot, &torn, &fresh);
+        printf("seqlock:    %ld interleavings, %ld torn, %ld retried to the new publish\n", n, torn, fresh);
+        CHECK(torn == 0, "read_snapshot() returned %ld torn copies", torn);
+        CHECK(fresh > 0, "no interleaving hit the copy window");
+    }
+#endif
+
+    signal(SIGALRM, on_alarm);
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 20;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_REAL, &it, NULL);
+    reads = 0;
+    gettimeofday(&t0, NULL);
+    do {
+        read_snapshot();
+        if (view_gen(&eg_view) < 0) FAIL("torn copy after %ld reads", reads);
+        reads++;
+        gettimeofday(&t1, NULL);
+    } while ((t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_usec - t0.tv_usec) < 1000000L);
+    memset(&it, 0, sizeof (it));
+    setitimer(ITIMER_REAL, &it, NULL);
+    printf("random:     %ld copies, %u publishes, none torn\n", reads, gen);
+    printf("PASS\n");
+    return 0;
+}
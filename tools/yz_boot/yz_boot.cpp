@@ -0,0 +1,371 @@
+/*--------------------------------------------------------------------------
+ YZ125/250 CDI bootloader uploader
+------------------------------------------------------------------------- */
+
+/*
+ Streams an application hex (built with -mcodeoffset=0x200) to the UART
+ bootloader in MPLAB_project/YZ_CDI_BOOT/boot.c. See there for the protocol.
+
+ Build:  g++ -std=c++17 -O2 -o yz_boot yz_boot.cpp
+ Usage:  yz_boot [options] app.hex
+   -p <port>    serial port (/dev/ttyUSB0)
+   -b <baud>    bootloader baud (500000). Must match BOOT_BRG
+   -a <baud>    application baud for the PB command (57600). 0: do not send
+   -B           hold break (RX low) while the CDI is power cycled
+   -k           keep the calibration store (rows from -e up are not written)
+   -e <addr>    end of the checked code area, word address (0x1EE0 = CAL_STORE_ADDR)
+   -n           dry run: parse the hex and print rows and CRC only
+
+ Rows from 0x200 up to the last used code row are always written, blank ones
+ as erased words, so the device CRC over that area matches the hex.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace {
+
+//-------------------------------
+// Device memory map (see boot.c)
+//-------------------------------
+constexpr uint32_t APP_ADDR = 0x200;
+constexpr uint32_t FLASH_END = 0x2000;
+constexpr uint32_t ROW_SIZE = 32;
+constexpr uint16_t ERASED = 0x3FFF;
+
+//-------------------------------
+// CRC16 CCITT (0x1021), same as boot.c
+//-------------------------------
+
+uint16_t crc_byte(uint16_t crc, uint8_t b) {
+    crc ^= static_cast<uint16_t>(b) << 8;
+    for (int a = 0; a < 8; a++) {
+        crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+    }
+    return crc;
+}
+
+//-------------------------------
+// Application image
+//-------------------------------
+
+struct Image {
+    std::vector<uint16_t> word = std::vector<uint16_t>(FLASH_END, ERASED);
+    std::vector<bool> used = std::vector<bool>(FLASH_END / ROW_SIZE, false);
+};
+
+int hex_byte(const std::string &s, size_t i) {
+    if (i + 2 > s.size()) return -1;
+    char *end;
+    std::string h = s.substr(i, 2);
+    long v = std::strtol(h.c_str(), &end, 16);
+    return (*end == '\0') ? static_cast<int>(v) : -1;
+}
+
+// Intel hex, byte addresses. Words above FLASH_END (config, ID) are skipped.
+bool load_hex(const char *path, Image &img) {
+    std::ifstream f(path);
+    if (!f) {
+        std::cerr << path << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    std::string line;
+    uint32_t base = 0;
+    int n = 0;
+    while (std::getline(f, line)) {
+        n++;
+        while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) line.pop_back();
+        if (line.empty()) continue;
+        if (line[0] != ':' || line.size() < 11) {
+            std::cerr << path << ":" << n << ": bad record\n";
+            return false;
+        }
+        std::vector<uint8_t> rec;
+        for (size_t i = 1; i + 1 < line.size(); i += 2) {
+            int b = hex_byte(line, i);
+            if (b < 0) {
+                std::cerr << path << ":" << n << ": bad hex digit\n";
+                return false;
+            }
+            rec.push_back(static_cast<uint8_t>(b));
+        }
+        uint8_t sum = 0;
+        for (uint8_t b : rec) sum += b;
+        if (sum != 0 || rec.size() != rec[0] + 5u) {
+            std::cerr << path << ":" << n << ": bad checksum or length\n";
+            return false;
+        }
+        uint8_t type = rec[3];
+        uint32_t addr = base + ((rec[1] << 8) | rec[2]);
+        if (type == 0x01) break;
+        if (type == 0x04) base = ((rec[4] << 8) | rec[5]) << 16;
+        if (type != 0x00) continue;
+        for (uint32_t i = 0; i < rec[0]; i++) {
+            uint32_t w = (addr + i) >> 1;
+            if (w >= FLASH_END) continue;
+            if (w < APP_ADDR) {
+                std::cerr << path << ": data at 0x" << std::hex << w << std::dec
+                          << " is in the boot block. Link the application with -mcodeoffset=0x200\n";
+                return false;
+            }
+            uint16_t &d = img.word[w];
+            d = ((addr + i) & 1) ? ((d & 0x00FF) | (rec[4 + i] << 8)) : ((d & 0xFF00) | rec[4 + i]);
+            d &= ERASED;
+            img.used[w / ROW_SIZE] = true;
+        }
+    }
+    return true;
+}
+
+//-------------------------------
+// Serial port
+//-------------------------------
+
+speed_t baud_const(long baud) {
+    switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B460800
+    case 460800: return B460800;
+#endif
+#ifdef B500000
+    case 500000: return B500000;
+#endif
+#ifdef B921600
+    case 921600: return B921600;
+#endif
+#ifdef B1000000
+    case 1000000: return B1000000;
+#endif
+    default: return 0;
+    }
+}
+
+class Port {
+public:
+    ~Port() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    bool open_port(const char *path) {
+        fd_ = open(path, O_RDWR | O_NOCTTY);
+        if (fd_ < 0) {
+            std::cerr << path << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool set_baud(long baud) {
+        speed_t s = baud_const(baud);
+        termios t{};
+        if (s == 0 || tcgetattr(fd_, &t) != 0) {
+            std::cerr << "baud " << baud << " not supported\n";
+            return false;
+        }
+        cfmakeraw(&t);
+        t.c_cflag |= CLOCAL | CREAD;
+        t.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+        t.c_cc[VMIN] = 0;
+        t.c_cc[VTIME] = 0;
+        cfsetispeed(&t, s);
+        cfsetospeed(&t, s);
+        if (tcsetattr(fd_, TCSANOW, &t) != 0) return false;
+        tcflush(fd_, TCIOFLUSH);
+        return true;
+    }
+
+    void set_break(bool on) {
+        ioctl(fd_, on ? TIOCSBRK : TIOCCBRK);
+    }
+
+    bool write_all(const uint8_t *p, size_t n) {
+        while (n > 0) {
+            ssize_t r = write(fd_, p, n);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            p += r;
+            n -= static_cast<size_t>(r);
+        }
+        return tcdrain(fd_) == 0;
+    }
+
+    // One byte, or -1 at timeout
+    int read_byte(int timeout_ms) {
+        auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (std::chrono::steady_clock::now() < until) {
+            uint8_t b;
+            if (read(fd_, &b, 1) == 1) return b;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        return -1;
+    }
+
+    void flush_input() {
+        tcflush(fd_, TCIFLUSH);
+    }
+
+private:
+    int fd_ = -1;
+};
+
+//-------------------------------
+// Bootloader frame
+// Retries on 'N' (frame CRC) or no reply. Returns the reply or -1.
+//-------------------------------
+
+int send_frame(Port &port, std::vector<uint8_t> frame, int timeout_ms, int tries) {
+    uint16_t crc = 0xFFFF;
+    for (uint8_t b : frame) crc = crc_byte(crc, b);
+    frame.push_back(crc & 0xFF);
+    frame.push_back(crc >> 8);
+    int r = -1;
+    for (int a = 0; a < tries; a++) {
+        port.flush_input();
+        if (!port.write_all(frame.data(), frame.size())) return -1;
+        r = port.read_byte(timeout_ms);
+        if (r == 'K' || r == 'E') break;
+    }
+    return r;
+}
+
+void put16(std::vector<uint8_t> &v, uint32_t w) {
+    v.push_back(w & 0xFF);
+    v.push_back((w >> 8) & 0xFF);
+}
+
+long parse_num(const char *s) {
+    return std::strtol(s, nullptr, 0);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    const char *port_name = "/dev/ttyUSB0";
+    const char *hex_name = nullptr;
+    long boot_baud = 500000;
+    long app_baud = 57600;
+    uint32_t code_end = 0x1EE0;
+    bool hold_break = false;
+    bool keep_cal = false;
+    bool dry_run = false;
+
+    for (int a = 1; a < argc; a++) {
+        std::string o = argv[a];
+        bool has_arg = a + 1 < argc;
+        if (o == "-p" && has_arg) port_name = argv[++a];
+        else if (o == "-b" && has_arg) boot_baud = parse_num(argv[++a]);
+        else if (o == "-a" && has_arg) app_baud = parse_num(argv[++a]);
+        else if (o == "-e" && has_arg) code_end = static_cast<uint32_t>(parse_num(argv[++a]));
+        else if (o == "-B") hold_break = true;
+        else if (o == "-k") keep_cal = true;
+        else if (o == "-n") dry_run = true;
+        else if (o[0] != '-' && hex_name == nullptr) hex_name = argv[a];
+        else {
+            std::cerr << "usage: yz_boot [-p port] [-b baud] [-a app_baud] [-B] [-k] [-e end] [-n] app.hex\n";
+            return 2;
+        }
+    }
+    if (hex_name == nullptr || code_end <= APP_ADDR || code_end > FLASH_END || (code_end % ROW_SIZE) != 0) {
+        std::cerr << "usage: yz_boot [-p port] [-b baud] [-a app_baud] [-B] [-k] [-e end] [-n] app.hex\n";
+        return 2;
+    }
+
+    Image img;
+    if (!load_hex(hex_name, img)) return 1;
+
+    //Checked area ends after the last used code row
+    uint32_t end = APP_ADDR;
+    for (uint32_t r = APP_ADDR / ROW_SIZE; r < code_end / ROW_SIZE; r++) {
+        if (img.used[r]) end = (r + 1) * ROW_SIZE;
+    }
+    if (end == APP_ADDR) {
+        std::cerr << hex_name << ": no code above 0x200\n";
+        return 1;
+    }
+    std::vector<uint32_t> rows;
+    for (uint32_t r = APP_ADDR / ROW_SIZE; r < FLASH_END / ROW_SIZE; r++) {
+        uint32_t addr = r * ROW_SIZE;
+        if (addr < end || (!keep_cal && addr >= code_end && img.used[r])) rows.push_back(addr);
+    }
+    uint16_t crc = 0xFFFF;
+    for (uint32_t w = APP_ADDR; w < end; w++) {
+        crc = crc_byte(crc, img.word[w] & 0xFF);
+        crc = crc_byte(crc, img.word[w] >> 8);
+    }
+    std::printf("%zu rows, code 0x%04X-0x%04X, CRC 0x%04X\n", rows.size(), APP_ADDR, end - 1, crc);
+    if (dry_run) {
+        for (uint32_t addr : rows) std::printf("  0x%04X%s\n", addr, addr >= code_end ? " cal" : "");
+        return 0;
+    }
+
+    Port port;
+    if (!port.open_port(port_name)) return 1;
+    if (hold_break) {
+        if (!port.set_baud(boot_baud)) return 1;
+        port.set_break(true);
+        std::printf("Power cycle the CDI, then press Enter\n");
+        std::getchar();
+        port.set_break(false);
+    } else if (app_baud != 0) {
+        //Application resets into the bootloader. Refused while the engine runs
+        if (!port.set_baud(app_baud)) return 1;
+        const uint8_t pb[] = {'P', 'B', '\r'};
+        port.write_all(pb, sizeof(pb));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    if (!port.set_baud(boot_baud)) return 1;
+
+    auto t0 = std::chrono::steady_clock::now();
+    if (send_frame(port, {'S'}, 100, 20) != 'K') {
+        std::cerr << "no reply from bootloader\n";
+        return 1;
+    }
+    size_t n = 0;
+    for (uint32_t addr : rows) {
+        std::vector<uint8_t> f{'W'};
+        put16(f, addr);
+        for (uint32_t a = 0; a < ROW_SIZE; a++) put16(f, img.word[addr + a]);
+        int r = send_frame(port, f, 500, 3);
+        if (r != 'K') {
+            std::cerr << "\nrow 0x" << std::hex << addr << std::dec << ": "
+                      << (r == 'E' ? "write error" : r < 0 ? "no reply" : "rejected") << "\n";
+            return 1;
+        }
+        std::printf("\r%zu/%zu", ++n, rows.size());
+        std::fflush(stdout);
+    }
+    std::printf("\n");
+    std::vector<uint8_t> v{'V'};
+    put16(v, end);
+    put16(v, crc);
+    int r = send_frame(port, v, 3000, 1);
+    if (r != 'K') {
+        std::cerr << "image check failed, application is not started\n";
+        return 1;
+    }
+    send_frame(port, {'R'}, 100, 1);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::printf("done in %.2fs\n", s);
+    return 0;
+}